@@ -0,0 +1,132 @@
+#!/usr/bin/env python3
+"""
+Build an asset partition image for OXRS devices.
+
+Packs every file in a directory into a read-only image which the library
+memory maps from the 'assets' data partition and serves at /assets/<name>.
+Files named 'adopt.<key>.json' are also added to the adoption info as <key>.
+
+  ./mkassets.py www/ assets.bin --gzip
+  esptool.py write_flash <assets partition offset> assets.bin
+
+Or embed them in the firmware instead, generating a header which defines
+addAssets(oxrs) to call before oxrs.begin() (it returns false if any asset
+was not added). More than 8 files needs -DASSETS_MAX_EMBEDDED=<n> in your
+build flags, the header will not compile otherwise:
+
+  ./mkassets.py www/ assets.h --gzip --header
+
+Add the partition to your partition table, e.g.
+  assets, data, 0x40, , 256K,
+
+Layout (little endian):
+  'OXA1', uint32 count
+  count x { char name[48], uint32 offset, uint32 length, uint32 flags }
+  asset data (offsets from the start of the image)
+"""
+
+import argparse
+import gzip
+import os
+import struct
+import sys
+
+MAGIC = 0x3141584f
+NAME_SIZE = 48
+FLAG_GZIP = 0x01
+
+# Worth compressing, and the browser will decompress for us
+GZIP_EXTENSIONS = ('.html', '.css', '.js', '.svg')
+
+
+def load_assets(directory, compress):
+  assets = []
+  for name in sorted(os.listdir(directory)):
+    path = os.path.join(directory, name)
+    if not os.path.isfile(path):
+      continue
+
+    if len(name.encode()) >= NAME_SIZE:
+      sys.exit('asset name too long: %s' % name)
+
+    with open(path, 'rb') as f:
+      data = f.read()
+
+    flags = 0
+    if compress and name.endswith(GZIP_EXTENSIONS):
+      # mtime=0 so identical input gives an identical image
+      data = gzip.compress(data, compresslevel=9, mtime=0)
+      flags |= FLAG_GZIP
+
+    assets.append((name, data, flags))
+
+  return assets
+
+
+def build_image(assets):
+  header = struct.pack('<II', MAGIC, len(assets))
+  offset = len(header) + len(assets) * (NAME_SIZE + 12)
+
+  entries = b''
+  data = b''
+  for name, content, flags in assets:
+    entries += struct.pack('<%dsIII' % NAME_SIZE, name.encode(), offset + len(data), len(content), flags)
+    data += content
+    # Keep each asset word aligned
+    data += b'\0' * (-len(data) % 4)
+
+  return header + entries + data
+
+
+def build_header(assets):
+  lines = ['// Generated by mkassets.py - do not edit', '#include <OXRS_32.h>', '']
+
+  lines.append('#if ASSETS_MAX_EMBEDDED < %d' % len(assets))
+  lines.append('#error "%d assets embedded, build with -DASSETS_MAX_EMBEDDED=%d"' % (len(assets), len(assets)))
+  lines.append('#endif')
+  lines.append('')
+
+  for index, (name, content, flags) in enumerate(assets):
+    lines.append('static const uint8_t ASSET_%d[] PROGMEM = {' % index)
+    for offset in range(0, len(content), 16):
+      lines.append('  ' + ', '.join('0x%02x' % b for b in content[offset:offset + 16]) + ',')
+    lines.append('};')
+    lines.append('')
+
+  lines.append('static boolean addAssets(OXRS_32 & oxrs)')
+  lines.append('{')
+  lines.append('  boolean success = true;')
+  for index, (name, content, flags) in enumerate(assets):
+    gzipped = 'true' if flags & FLAG_GZIP else 'false'
+    lines.append('  success &= oxrs.addAsset("%s", ASSET_%d, sizeof(ASSET_%d), %s);' % (name, index, index, gzipped))
+  lines.append('  return success;')
+  lines.append('}')
+
+  return '\n'.join(lines) + '\n'
+
+
+def main():
+  parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+  parser.add_argument('directory', help='directory of assets to pack')
+  parser.add_argument('output', help='image file to write')
+  parser.add_argument('--gzip', action='store_true', help='precompress text assets')
+  parser.add_argument('--header', action='store_true', help='write a C header to embed in the firmware')
+  args = parser.parse_args()
+
+  assets = load_assets(args.directory, args.gzip)
+
+  if args.header:
+    with open(args.output, 'w') as f:
+      f.write(build_header(assets))
+    size = sum(len(content) for name, content, flags in assets)
+  else:
+    image = build_image(assets)
+    with open(args.output, 'wb') as f:
+      f.write(image)
+    size = len(image)
+
+  print('%d assets, %d bytes' % (len(assets), size))
+
+
+if __name__ == '__main__':
+  main()
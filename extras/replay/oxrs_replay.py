@@ -0,0 +1,170 @@
+#!/usr/bin/env python3
+"""
+Replay MQTT traffic captured by an OXRS device (see the 'capture' command).
+
+Reads a capture (GET /capture, or a serial log containing 'CAP' records),
+publishes each message to a broker at its original timing (or faster), and
+optionally asks the target device for its runtime stats afterwards so you
+can see processing latency and memory behaviour for that traffic.
+
+  pip install paho-mqtt
+  ./oxrs_replay.py capture.log --broker 192.168.1.10 --speed 10 --stats
+
+With --bench, each capture is treated as a benchmark case (see corpus/) and
+replayed as fast as possible --repeat times, reporting per case the mean
+time spent in the inbound pipeline per message and the device's heap
+low-water mark since boot (so not per case - restart the device between
+cases to attribute it to one):
+
+  ./oxrs_replay.py corpus/*.log --broker 192.168.1.10 --client-id a1b2c3 --bench
+
+PubSubClient silently drops anything bigger than its buffer, and the library
+only grows that buffer for messages it has seen, so for corpus/oversized-
+config.log (an 11243 byte packet) build the device firmware with
+-DMQTT_MIN_BUFFER_SIZE=12288. A case fails if the device didn't dispatch
+every message replayed.
+
+Record format:
+  CAP <ms> <topic length> <payload length> <topic><payload>\n
+"""
+
+import argparse
+import json
+import os
+import sys
+import time
+
+import paho.mqtt.client as mqtt
+
+
+def read_capture(path):
+  with open(path, 'rb') as f:
+    data = f.read()
+
+  records = []
+  pos = data.find(b'CAP ')
+  while pos != -1:
+    # Header is 'CAP <ms> <topic length> <payload length> '
+    parts = data[pos:pos + 64].split(b' ', 4)
+    if len(parts) < 5:
+      break
+
+    ms, topic_length, payload_length = int(parts[1]), int(parts[2]), int(parts[3])
+    start = pos + len(b' '.join(parts[:4])) + 1
+    topic = data[start:start + topic_length].decode()
+    payload = data[start + topic_length:start + topic_length + payload_length]
+    records.append((ms, topic, payload))
+
+    pos = data.find(b'CAP ', start + topic_length + payload_length)
+
+  return records
+
+
+def request_stats(client, client_id, inbox, timeout=5):
+  inbox.clear()
+  client.publish('cmnd/%s' % client_id, json.dumps({'stats': True})).wait_for_publish()
+
+  deadline = time.monotonic() + timeout
+  while time.monotonic() < deadline:
+    for payload in list(inbox):
+      if b'"stats"' in payload:
+        return json.loads(payload)['stats']
+    time.sleep(0.05)
+
+  return None
+
+
+def replay(client, records, captured_id, client_id, speed):
+  start = time.monotonic()
+  first_ms = records[0][0]
+  for ms, topic, payload in records:
+    if speed > 0:
+      due = start + (ms - first_ms) / 1000.0 / speed
+      time.sleep(max(0, due - time.monotonic()))
+
+    client.publish(topic.replace(captured_id, client_id, 1), payload).wait_for_publish()
+
+  return time.monotonic() - start
+
+
+def bench(client, captures, client_id, inbox, repeat):
+  print('%-28s %8s %12s %16s' % ('case', 'messages', 'ns/message', 'bootMinFreeHeap'))
+
+  for path in captures:
+    records = read_capture(path)
+    if not records:
+      continue
+
+    # Each stats snapshot includes the dispatch of the command asking for
+    # it, so take two back to back to measure (and later subtract) that
+    calibrate = request_stats(client, client_id, inbox)
+    before = request_stats(client, client_id, inbox)
+    for _ in range(repeat):
+      replay(client, records, records[0][1].split('/')[1], client_id, 0)
+    after = request_stats(client, client_id, inbox)
+
+    if not calibrate or not before or not after:
+      sys.exit('no stats received from device')
+
+    stats_us = before['mqttReceive']['totalDispatchUs'] - calibrate['mqttReceive']['totalDispatchUs']
+    messages = after['mqttReceive']['dispatches'] - before['mqttReceive']['dispatches'] - 1
+    elapsed_us = after['mqttReceive']['totalDispatchUs'] - before['mqttReceive']['totalDispatchUs'] - stats_us
+
+    if messages != len(records) * repeat:
+      sys.exit('%s: device dispatched %d of %d messages (too big for its MQTT buffer?)' % (os.path.basename(path), messages, len(records) * repeat))
+
+    ns = elapsed_us * 1000 // messages
+
+    print('%-28s %8d %12d %16d' % (os.path.basename(path), messages, ns, after['heap']['minFreeBytes']))
+
+
+def main():
+  parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+  parser.add_argument('captures', nargs='+', help='capture file(s)')
+  parser.add_argument('--broker', default='localhost')
+  parser.add_argument('--port', type=int, default=1883)
+  parser.add_argument('--username')
+  parser.add_argument('--password')
+  parser.add_argument('--speed', type=float, default=1.0, help='replay speed multiplier (0 for as fast as possible)')
+  parser.add_argument('--client-id', help='replace the captured device client id with this one')
+  parser.add_argument('--stats', action='store_true', help='request runtime stats from the device when done')
+  parser.add_argument('--bench', action='store_true', help='benchmark each capture as a separate case')
+  parser.add_argument('--repeat', type=int, default=10, help='replays per case when benchmarking')
+  args = parser.parse_args()
+
+  records = read_capture(args.captures[0])
+  if not records:
+    sys.exit('no capture records found')
+
+  # Topics are <type>/<client id>[/...] unless a prefix/suffix is configured
+  captured_id = records[0][1].split('/')[1]
+  client_id = args.client_id or captured_id
+
+  client = mqtt.Client()
+  if args.username:
+    client.username_pw_set(args.username, args.password)
+
+  inbox = []
+  client.on_message = lambda c, u, msg: inbox.append(msg.payload)
+  client.connect(args.broker, args.port)
+  client.subscribe('tele/%s' % client_id)
+  client.loop_start()
+
+  if args.bench:
+    bench(client, args.captures, client_id, inbox, args.repeat)
+  else:
+    for path in args.captures:
+      records = read_capture(path)
+      elapsed = replay(client, records, records[0][1].split('/')[1], client_id, args.speed) if records else 0
+      print('%s: replayed %d messages in %.2fs' % (path, len(records), elapsed))
+
+    if args.stats:
+      stats = request_stats(client, client_id, inbox)
+      print(json.dumps(stats, indent=2) if stats else 'no stats received from device')
+
+  client.loop_stop()
+  client.disconnect()
+
+
+if __name__ == '__main__':
+  main()
@@ -6,57 +6,1530 @@
 #include "OXRS_32.h"
 
 #include <WiFi.h>                     // Required for Ethernet to get MAC
+#if !defined(OXRS_32_DISABLE_REST_API)
 #include <LittleFS.h>                 // For file system access
+#endif
+#if defined(OXRS_32_ENABLE_OTA) && !defined(OXRS_32_DISABLE_REST_API)
+#include <Update.h>                   // For OTA firmware updates
+#endif
+#if !defined(OXRS_32_DISABLE_LOGGER)
 #include <MqttLogger.h>               // For logging
+#endif
 #include <WiFiManager.h>              // For WiFi AP config
 
-// Macro for converting env vars to strings
-#define STRINGIFY(s) STRINGIFY1(s)
-#define STRINGIFY1(s) #s
+#include <esp_wifi.h>                 // For WiFi power save settings
+#include <esp_partition.h>            // For the asset partition
+#include <sys/time.h>                 // For message timestamps
+#include <esp_sntp.h>                 // For syncing message timestamps
+#include <lwip/sockets.h>             // For select() when idle
+#include <lwip/dns.h>                 // For async DNS revalidation
+#if CONFIG_PM_ENABLE
+#include <esp_pm.h>                   // For automatic light sleep
+#endif
+
+#if defined(OXRS_32_MQTT_TLS)
+#include <WiFiClientSecure.h>         // For MQTT over TLS
+typedef WiFiClientSecure mqttNetworkClient_t;
+#else
+typedef WiFiClient mqttNetworkClient_t;
+#endif
+
+// Macro for converting env vars to strings
+#define STRINGIFY(s) STRINGIFY1(s)
+#define STRINGIFY1(s) #s
+
+// MQTT transport connection setup (TCP + TLS handshake if enabled)
+uint32_t _transportConnects = 0;
+uint32_t _transportFailures = 0;
+uint32_t _transportLastMs = 0;
+uint32_t _transportMinMs = UINT32_MAX;
+uint32_t _transportMaxMs = 0;
+
+void _transportConnected(uint32_t start, int result)
+{
+  uint32_t elapsed = millis() - start;
+  _transportLastMs = elapsed;
+
+  if (!result)
+  {
+    _transportFailures++;
+    return;
+  }
+
+  _transportConnects++;
+  if (elapsed < _transportMinMs) { _transportMinMs = elapsed; }
+  if (elapsed > _transportMaxMs) { _transportMaxMs = elapsed; }
+}
+
+// Wraps the network client so we can time connection setup
+class MqttNetworkClient : public mqttNetworkClient_t
+{
+  public:
+    using mqttNetworkClient_t::connect;
+
+    int connect(IPAddress ip, uint16_t port)
+    {
+      uint32_t start = millis();
+      int result = mqttNetworkClient_t::connect(ip, port);
+      _transportConnected(start, result);
+      return result;
+    }
+
+    // Resolves via our DNS cache, see below
+    int connect(const char * host, uint16_t port);
+
+    // Underlying socket, for select() when idle
+    int socketFd()
+    {
+#if defined(OXRS_32_MQTT_TLS)
+      // WiFiClientSecure keeps its own socket, fd() is always -1
+      return sslclient ? sslclient->socket : -1;
+#else
+      return fd();
+#endif
+    }
+};
+
+// Network client (for MQTT)/server (for REST API)
+MqttNetworkClient _client;
+#if !defined(OXRS_32_DISABLE_REST_API)
+WiFiServer _server(REST_API_PORT);
+#endif
+
+// MQTT client
+PubSubClient _mqttClient(_client);
+OXRS_MQTT _mqtt(_mqttClient);
+
+// REST API
+#if !defined(OXRS_32_DISABLE_REST_API)
+OXRS_API _api(_mqtt);
+#endif
+
+// Logging (topic updated once MQTT connects successfully)
+#if defined(OXRS_32_DISABLE_LOGGER)
+Print & _logger = Serial;
+#else
+MqttLogger _logger(_mqttClient, "log", MqttLoggerMode::MqttAndSerial);
+#endif
+
+// Supported firmware config and command schemas
+DynamicJsonDocument _fwConfigSchema(JSON_CONFIG_MAX_SIZE);
+DynamicJsonDocument _fwCommandSchema(JSON_COMMAND_MAX_SIZE);
+
+// MQTT callbacks wrapped by _mqttConfig/_mqttCommand
+jsonCallback _onConfig;
+jsonCallback _onCommand;
+
+// Boot profile - time from reset to the end of each phase of begin()
+typedef struct
+{
+  const char *  name;
+  uint32_t      endUs;
+} bootPhase_t;
+
+bootPhase_t _bootPhases[BOOT_MAX_PHASES];
+uint8_t _bootPhaseCount = 0;
+uint32_t _bootMqttConnectedUs = 0;
+
+// CPU frequency governor, profiles from fastest to slowest (WiFi
+// needs at least 80MHz)
+const uint32_t _governorMhz[GOVERNOR_PROFILES] = { 240, 160, 80 };
+
+boolean _governorEnabled = false;
+uint8_t _governorProfile = 0;
+uint32_t _governorProfileStartMs = 0;
+uint32_t _governorLastStepMs = 0;
+uint32_t _governorRampUps = 0;
+uint32_t _governorTimeMs[GOVERNOR_PROFILES];
+uint32_t _governorMaxLoopUs[GOVERNOR_PROFILES];
+
+// WiFi latency/power profiles, indexed by wifiProfile_t
+typedef struct
+{
+  const char *  name;
+  wifi_ps_type_t powerSave;
+  wifi_power_t  txPower;
+  uint16_t      listenInterval;
+} wifiProfileSettings_t;
+
+const wifiProfileSettings_t _wifiProfiles[] = 
+{
+  { "lowLatency", WIFI_PS_NONE,      WIFI_POWER_19_5dBm, 1  },
+  { "balanced",   WIFI_PS_MIN_MODEM, WIFI_POWER_17dBm,   3  },
+  { "lowPower",   WIFI_PS_MAX_MODEM, WIFI_POWER_11dBm,   10 },
+};
+
+int8_t _wifiProfile = -1;
+int8_t _wifiProfileRequested = -1;
+
+// Whether we had WiFi creds saved at boot (if not we go straight to the
+// captive portal)
+boolean _wifiSaved = false;
+
+// Streaming config
+boolean _configStreaming = false;
+uint32_t _configFragments = 0;
+uint32_t _configFragmentMaxBytes = 0;
+
+// Message stamping
+boolean _stampingEnabled = false;
+char _stampingNtpServer[64];
+uint32_t _statusSeq = 0;
+uint32_t _telemetrySeq = 0;
+uint64_t _lastStampMs = 0;
+
+// Deferred dispatch queue for inbound MQTT messages, allocated once
+// when first enabled
+typedef struct
+{
+  uint32_t      receivedUs;
+  uint16_t      length;
+  char          topic[64];
+  byte          payload[MQTT_RX_QUEUE_SLOT_SIZE];
+} rxSlot_t;
+
+boolean _rxDeferred = false;
+rxSlot_t * _rxQueue = NULL;
+uint8_t _rxHead = 0;
+uint8_t _rxCount = 0;
+
+uint32_t _rxQueued = 0;
+uint32_t _rxInline = 0;
+uint32_t _rxDropped = 0;
+uint8_t _rxDepthHighWater = 0;
+uint32_t _rxWaitTotalUs = 0;
+uint32_t _rxWaitMaxUs = 0;
+uint32_t _rxDispatches = 0;
+uint32_t _rxDispatchTotalUs = 0;
+uint32_t _rxDispatchMaxUs = 0;
+
+// Firmware handler execution times, with a log2 histogram (bucket n
+// counts calls taking less than 2^(n+1) us) for percentiles
+typedef struct
+{
+  uint32_t      calls;
+  uint32_t      slow;
+  uint32_t      minUs;
+  uint32_t      maxUs;
+  uint64_t      totalUs;
+  uint32_t      histogram[32];
+} handlerTiming_t;
+
+handlerTiming_t _configTiming;
+handlerTiming_t _commandTiming;
+uint32_t _handlerWarningUs = 0;
+
+// Sampling CPU profiler - program counter histogram filled by a timer
+// interrupt, allocated the first time the profiler runs
+typedef struct
+{
+  uint32_t      pc;
+  uint32_t      count;
+} profilerBucket_t;
+
+profilerBucket_t * _profilerBuckets = NULL;
+hw_timer_t * _profilerTimer = NULL;
+uint32_t _profilerEndMs = 0;
+volatile uint32_t _profilerSamples = 0;
+volatile uint32_t _profilerDropped = 0;
+
+// MQTT traffic capture, each inbound message is recorded as
+//   CAP <ms> <topic length> <payload length> <topic><payload>\n
+enum captureMode_t { CAPTURE_MODE_OFF, CAPTURE_MODE_SERIAL, CAPTURE_MODE_FILE };
+
+captureMode_t _captureMode = CAPTURE_MODE_OFF;
+uint32_t _captureMessages = 0;
+uint32_t _captureBytes = 0;
+#if !defined(OXRS_32_DISABLE_REST_API)
+File _captureFile;
+#endif
+
+// Adoption builder timings, indexed in the order _apiAdopt() calls them
+// (names match the key each builder adds)
+#define ADOPT_BUILDERS 5
+
+const char * _adoptBuilderNames[ADOPT_BUILDERS] = { "firmware", "system", "network", "configSchema", "commandSchema" };
+
+typedef struct
+{
+  uint32_t      calls;
+  uint32_t      totalUs;
+  uint32_t      maxUs;
+  uint32_t      memoryBytes;
+  uint32_t      outputBytes;
+} adoptTiming_t;
+
+adoptTiming_t _adoptTiming[ADOPT_BUILDERS];
+
+// Asset partition layout, all little endian:
+//   header, header.count entries, then the asset data (offsets are from
+//   the start of the partition)
+typedef struct
+{
+  uint32_t      magic;
+  uint32_t      count;
+} assetHeader_t;
+
+typedef struct
+{
+  char          name[ASSETS_NAME_SIZE];
+  uint32_t      offset;
+  uint32_t      length;
+  uint32_t      flags;
+} assetEntry_t;
+
+const uint8_t * _assets = NULL;
+uint32_t _assetsSize = 0;
+spi_flash_mmap_handle_t _assetsHandle;
+
+// An asset from either the partition or embedded in the firmware
+typedef struct
+{
+  const char *    name;
+  const uint8_t * data;
+  uint32_t        length;
+  uint32_t        flags;
+} asset_t;
+
+asset_t _embeddedAssets[ASSETS_MAX_EMBEDDED];
+uint8_t _embeddedAssetCount = 0;
+
+// Network self test - broker TCP connect latency is sampled once per
+// loop() so we keep servicing I/O, REST throughput is measured whenever
+// a client hits /selftest
+uint8_t _selfTestRemaining = 0;
+IPAddress _selfTestIp;
+uint16_t _selfTestPort = 0;
+uint32_t _selfTestSamples = 0;
+uint32_t _selfTestFailures = 0;
+uint32_t _selfTestTotalMs = 0;
+uint32_t _selfTestMinMs = 0;
+uint32_t _selfTestMaxMs = 0;
+uint32_t _selfTestDownloadBps = 0;
+uint32_t _selfTestUploadBps = 0;
+
+// Set whenever loop() has work to do, so we know when we are idle
+boolean _loopActive = false;
+
+// Idle sleep
+uint32_t _idleSleepMaxMs = 0;
+uint32_t _idleSleepEnabledMs = 0;
+uint32_t _idleSleeps = 0;
+uint32_t _idleSocketWakes = 0;
+uint32_t _idleSleptMs = 0;
+
+// Replies to generic commands, published from loop() since the command
+// handler can run inside the MQTT callback, where the command JSON still
+// points into the MQTT library's buffer (which any publish overwrites)
+boolean _pongPending = false;
+long _pongValue = 0;
+boolean _statsPending = false;
+uint32_t _benchAdoptPending = 0;
+
+// OTA firmware updates
+uint32_t _otaBytes = 0;
+uint32_t _otaDurationMs = 0;
+uint32_t _otaRestartMs = 0;
+
+// Status messages waiting to be retried after a failed publish
+typedef struct
+{
+  uint8_t       attempts;
+  uint32_t      lastAttemptMs;
+  char          payload[MQTT_RETRY_PAYLOAD_SIZE];
+} retrySlot_t;
+
+retrySlot_t _retryWindow[MQTT_RETRY_WINDOW_SIZE];
+uint8_t _retryHead = 0;
+uint8_t _retryCount = 0;
+
+uint32_t _retryQueued = 0;
+uint32_t _retrySent = 0;
+uint32_t _retryDropped = 0;
+
+// Outbound stat/ and tele/ traffic, to show how much is topic overhead
+uint32_t _publishCount = 0;
+uint32_t _publishTopicBytes = 0;
+uint32_t _publishPayloadBytes = 0;
+
+// MQTT brokers - the broker configured via the API (index -1, picked up
+// when the MQTT library first connects to it) is used until it fails, at
+// which point we switch to the healthiest candidate, and fail back to it
+// once it is reachable again
+typedef struct
+{
+  char          host[64];
+  uint16_t      port;
+  uint8_t       failures;
+  uint32_t      connectMs;
+} broker_t;
+
+broker_t _brokerConfigured;
+broker_t _brokers[MQTT_MAX_BROKERS];
+uint8_t _brokerCount = 0;
+int8_t _brokerActive = -1;
+uint32_t _brokerFailovers = 0;
+uint32_t _brokerFailbacks = 0;
+uint32_t _brokerProbeMs = 0;
+
+// DNS cache for broker hostnames - in RTC memory so it survives
+// a warm restart, although entries are treated as stale after a restart
+#define DNS_CACHE_MAGIC 0x444e5343
+
+typedef struct
+{
+  char          host[64];
+  uint32_t      ip;
+  uint32_t      resolvedMs;
+  boolean       fresh;
+  boolean       revalidate;
+} dnsEntry_t;
+
+RTC_NOINIT_ATTR uint32_t _dnsCacheMagic;
+RTC_NOINIT_ATTR dnsEntry_t _dnsCache[DNS_CACHE_SIZE];
+
+uint32_t _dnsHits = 0;
+uint32_t _dnsStaleHits = 0;
+uint32_t _dnsMisses = 0;
+uint32_t _dnsFailures = 0;
+uint32_t _dnsLastResolveMs = 0;
+uint32_t _dnsMaxResolveMs = 0;
+
+// Async revalidation in flight (cache index, or -1), the result is set
+// from the lwIP task and picked up by loop()
+int8_t _dnsPending = -1;
+uint32_t _dnsPendingStartMs = 0;
+volatile boolean _dnsPendingDone = false;
+volatile boolean _dnsPendingSuccess = false;
+volatile uint32_t _dnsPendingIp = 0;
+
+// MQTT buffer sizing (can't resize while the buffer holds a received message)
+boolean _inMqttCallback = false;
+uint32_t _mqttInboundHighWater = 0;
+uint32_t _mqttOutboundHighWater = 0;
+uint32_t _mqttBufferResizes = 0;
+uint32_t _mqttBufferFloor = MQTT_MIN_BUFFER_SIZE;
+
+/* JSON helpers */
+void _mergeJson(JsonVariant dst, JsonVariantConst src)
+{
+  if (src.is<JsonObjectConst>())
+  {
+    for (JsonPairConst kvp : src.as<JsonObjectConst>())
+    {
+      if (dst[kvp.key()])
+      {
+        _mergeJson(dst[kvp.key()], kvp.value());
+      }
+      else
+      {
+        dst[kvp.key()] = kvp.value();
+      }
+    }
+  }
+  else
+  {
+    dst.set(src);
+  }
+}
+
+/* Boot profiler */
+void _bootPhase(const char * name)
+{
+  if (_bootPhaseCount >= BOOT_MAX_PHASES) { return; }
+
+  _bootPhases[_bootPhaseCount].name = name;
+  _bootPhases[_bootPhaseCount].endUs = micros();
+  _bootPhaseCount++;
+}
+
+void _getBootJson(JsonVariant json)
+{
+  JsonObject boot = json.createNestedObject("boot");
+
+  // Each phase runs from the end of the previous one (or from reset)
+  uint32_t startUs = 0;
+  for (uint8_t i = 0; i < _bootPhaseCount; i++)
+  {
+    boot[_bootPhases[i].name] = (_bootPhases[i].endUs - startUs) / 1000;
+    startUs = _bootPhases[i].endUs;
+  }
+
+  if (_bootMqttConnectedUs)
+  {
+    boot["mqttConnectedMs"] = _bootMqttConnectedUs / 1000;
+  }
+}
+
+void _logBootProfile(void)
+{
+  _logger.print(F("[esp32] boot profile (ms): "));
+
+  uint32_t startUs = 0;
+  for (uint8_t i = 0; i < _bootPhaseCount; i++)
+  {
+    _logger.print(_bootPhases[i].name);
+    _logger.print(F("="));
+    _logger.print((_bootPhases[i].endUs - startUs) / 1000);
+    _logger.print(F(" "));
+    startUs = _bootPhases[i].endUs;
+  }
+
+  _logger.print(F("mqttConnected="));
+  _logger.println(_bootMqttConnectedUs / 1000);
+}
+
+/* CPU frequency governor */
+void _governorSet(uint8_t profile)
+{
+  if (profile == _governorProfile) { return; }
+
+  // Account for time spent in the profile we are leaving
+  uint32_t now = millis();
+  _governorTimeMs[_governorProfile] += now - _governorProfileStartMs;
+  _governorProfileStartMs = now;
+  _governorLastStepMs = now;
+
+  _governorProfile = profile;
+  setCpuFrequencyMhz(_governorMhz[profile]);
+}
+
+void _governorActivity(void)
+{
+  if (!_governorEnabled) { return; }
+
+  // Always restart the idle period, ramping straight up if not already
+  _governorLastStepMs = millis();
+  if (_governorProfile != 0)
+  {
+    _governorRampUps++;
+    _governorSet(0);
+  }
+}
+
+void _governorLoop(uint32_t loopUs)
+{
+  if (!_governorEnabled) { return; }
+
+  // Worst case loop time per profile, i.e. the latency cost of each
+  if (loopUs > _governorMaxLoopUs[_governorProfile])
+  {
+    _governorMaxLoopUs[_governorProfile] = loopUs;
+  }
+
+  // Step down a profile for each idle period with no activity
+  if (_governorProfile < (GOVERNOR_PROFILES - 1) && (millis() - _governorLastStepMs) > GOVERNOR_IDLE_MS)
+  {
+    _governorSet(_governorProfile + 1);
+  }
+}
+
+void _getGovernorJson(JsonVariant json)
+{
+  JsonObject governor = json.createNestedObject("cpuGovernor");
+  governor["enabled"] = _governorEnabled;
+  governor["cpuMhz"] = getCpuFrequencyMhz();
+  governor["rampUps"] = _governorRampUps;
+
+  JsonArray profiles = governor.createNestedArray("profiles");
+  for (uint8_t i = 0; i < GOVERNOR_PROFILES; i++)
+  {
+    uint32_t timeMs = _governorTimeMs[i];
+    if (_governorEnabled && i == _governorProfile) { timeMs += millis() - _governorProfileStartMs; }
+
+    JsonObject profile = profiles.createNestedObject();
+    profile["mhz"] = _governorMhz[i];
+    profile["timeMs"] = timeMs;
+    profile["maxLoopUs"] = _governorMaxLoopUs[i];
+  }
+}
+
+/* WiFi profiles */
+boolean _wifiApplyProfile(wifiProfile_t profile)
+{
+  const wifiProfileSettings_t * settings = &_wifiProfiles[profile];
+  _wifiProfileRequested = profile;
+
+  // Needs the WiFi driver started, we try again from begin() if not
+  if (WiFi.getMode() == WIFI_MODE_NULL) { return false; }
+
+  // Via WiFi.setSleep() rather than esp_wifi_set_ps() directly, so the
+  // Arduino core doesn't put back its own setting when the STA restarts
+  boolean success = WiFi.setSleep(settings->powerSave);
+  success &= WiFi.setTxPower(settings->txPower);
+
+  // Only used when associating, and only with max modem power save
+  wifi_config_t config;
+  success &= esp_wifi_get_config(WIFI_IF_STA, &config) == ESP_OK;
+  if (success)
+  {
+    config.sta.listen_interval = settings->listenInterval;
+    success &= esp_wifi_set_config(WIFI_IF_STA, &config) == ESP_OK;
+  }
+
+  if (!success)
+  {
+    _logger.print(F("[esp32] failed to apply wifi profile: "));
+    _logger.println(settings->name);
+    return false;
+  }
+
+  _wifiProfile = profile;
+
+  _logger.print(F("[esp32] wifi profile: "));
+  _logger.println(settings->name);
+  return true;
+}
+
+void _wifiConfig(JsonVariant json)
+{
+  if (!json.containsKey("wifiProfile")) { return; }
+
+  for (uint8_t i = 0; i < sizeof(_wifiProfiles) / sizeof(_wifiProfiles[0]); i++)
+  {
+    if (strcmp(_wifiProfiles[i].name, json["wifiProfile"] | "") == 0)
+    {
+      if (i != _wifiProfile) { _wifiApplyProfile((wifiProfile_t)i); }
+      return;
+    }
+  }
+
+  _logger.println(F("[esp32] invalid wifi profile"));
+}
+
+/* Idle sleep */
+void _loopActivity(void)
+{
+  _loopActive = true;
+  _governorActivity();
+}
+
+void _idleSleep(void)
+{
+  if (_idleSleepMaxMs == 0) { return; }
+
+  // Data already pulled off the socket (into WiFiClient's receive buffer,
+  // or decrypted by TLS) won't wake select(), and the MQTT library only
+  // handles one packet per loop(), so don't sleep on it
+  if (_client.available()) { return; }
+
+  // Block the loop task, letting the idle task run (and the SoC light
+  // sleep if power management is enabled) until MQTT data arrives or
+  // we time out - REST clients are only picked up on timeout
+  struct timeval timeout;
+  timeout.tv_sec = _idleSleepMaxMs / 1000;
+  timeout.tv_usec = (_idleSleepMaxMs % 1000) * 1000;
+
+  uint32_t start = millis();
+  int fd = _client.connected() ? _client.socketFd() : -1;
+  if (fd >= 0)
+  {
+    fd_set readfds;
+    FD_ZERO(&readfds);
+    FD_SET(fd, &readfds);
+    if (select(fd + 1, &readfds, NULL, NULL, &timeout) > 0) { _idleSocketWakes++; }
+  }
+  else
+  {
+    delay(_idleSleepMaxMs);
+  }
+
+  _idleSleeps++;
+  _idleSleptMs += millis() - start;
+}
+
+void _getIdleSleepJson(JsonVariant json)
+{
+  JsonObject idleSleep = json.createNestedObject("idleSleep");
+  idleSleep["maxSleepMs"] = _idleSleepMaxMs;
+  if (_idleSleepMaxMs == 0) { return; }
+
+  idleSleep["sleeps"] = _idleSleeps;
+  idleSleep["socketWakes"] = _idleSocketWakes;
+  idleSleep["sleptMs"] = _idleSleptMs;
+
+  uint32_t enabledMs = millis() - _idleSleepEnabledMs;
+  if (enabledMs > 0)
+  {
+    idleSleep["awakePercent"] = 100 - (uint32_t)((uint64_t)_idleSleptMs * 100 / enabledMs);
+  }
+}
+
+/* Firmware handler timing */
+void _timeHandler(handlerTiming_t * timing, const __FlashStringHelper * name, jsonCallback handler, JsonVariant json)
+{
+  uint32_t start = ESP.getCycleCount();
+  handler(json);
+  uint32_t cycles = ESP.getCycleCount() - start;
+
+  // NOTE: the CPU governor only changes frequency outside handlers
+  uint32_t elapsed = cycles / getCpuFrequencyMhz();
+
+  if (timing->calls == 0 || elapsed < timing->minUs) { timing->minUs = elapsed; }
+  if (elapsed > timing->maxUs) { timing->maxUs = elapsed; }
+  timing->totalUs += elapsed;
+  timing->calls++;
+  timing->histogram[elapsed ? 31 - __builtin_clz(elapsed) : 0]++;
+
+  if (_handlerWarningUs && elapsed > _handlerWarningUs)
+  {
+    timing->slow++;
+
+    _logger.print(F("[esp32] slow "));
+    _logger.print(name);
+    _logger.print(F(" handler (us): "));
+    _logger.println(elapsed);
+  }
+}
+
+void _getHandlerTimingJson(JsonVariant json, const char * name, handlerTiming_t * timing)
+{
+  JsonObject handler = json.createNestedObject(name);
+  handler["calls"] = timing->calls;
+  handler["slow"] = timing->slow;
+  if (timing->calls == 0) { return; }
+
+  handler["minUs"] = timing->minUs;
+  handler["avgUs"] = (uint32_t)(timing->totalUs / timing->calls);
+  handler["maxUs"] = timing->maxUs;
+
+  // Upper bound of the bucket containing the 99th percentile
+  uint32_t target = timing->calls - (timing->calls / 100);
+  uint32_t count = 0;
+  for (uint8_t i = 0; i < 32; i++)
+  {
+    count += timing->histogram[i];
+    if (count >= target)
+    {
+      handler["p99Us"] = min((uint32_t)((2ULL << i) - 1), timing->maxUs);
+      break;
+    }
+  }
+}
+
+/* Sampling CPU profiler */
+#if defined(__XTENSA__)
+void IRAM_ATTR _profilerSample(void)
+{
+  // EPC1 holds the PC the level 1 timer interrupt interrupted
+  // NOTE: a window exception in the interrupt dispatcher before we get
+  //       here overwrites it, so the odd sample lands in ISR code
+  uint32_t pc;
+  asm volatile ("rsr %0, epc1" : "=r"(pc));
+
+  // Open addressing, with a short probe so the ISR time is bounded
+  uint32_t index = (pc >> 2) % PROFILER_BUCKETS;
+  for (uint8_t probe = 0; probe < 8; probe++)
+  {
+    profilerBucket_t * bucket = &_profilerBuckets[index];
+    if (bucket->pc == pc || bucket->pc == 0)
+    {
+      bucket->pc = pc;
+      bucket->count++;
+      _profilerSamples++;
+      return;
+    }
+    index = (index + 1) % PROFILER_BUCKETS;
+  }
+
+  _profilerDropped++;
+}
+
+void _profilerStop(void)
+{
+  if (!_profilerTimer) { return; }
+
+  timerEnd(_profilerTimer);
+  _profilerTimer = NULL;
+  _profilerEndMs = 0;
+
+  _logger.print(F("[esp32] profiler stopped, samples: "));
+  _logger.println(_profilerSamples);
+}
+
+void _profilerStart(uint32_t seconds)
+{
+  _profilerStop();
+
+  if (!_profilerBuckets)
+  {
+    _profilerBuckets = (profilerBucket_t *)malloc(sizeof(profilerBucket_t) * PROFILER_BUCKETS);
+    if (!_profilerBuckets) { return; }
+  }
+
+  memset(_profilerBuckets, 0, sizeof(profilerBucket_t) * PROFILER_BUCKETS);
+  _profilerSamples = 0;
+  _profilerDropped = 0;
+
+  // 1MHz tick, interrupt allocated on this (the loop task's) core
+  _profilerTimer = timerBegin(PROFILER_TIMER, 80, true);
+  timerAttachInterrupt(_profilerTimer, &_profilerSample, false);
+  timerAlarmWrite(_profilerTimer, 1000000 / PROFILER_SAMPLE_HZ, true);
+  timerAlarmEnable(_profilerTimer);
+
+  _profilerEndMs = millis() + (min(seconds, (uint32_t)PROFILER_MAX_SECONDS) * 1000);
+
+  _logger.print(F("[esp32] profiler started, seconds: "));
+  _logger.println(seconds);
+}
+
+void _profilerLoop(void)
+{
+  if (_profilerTimer && (int32_t)(millis() - _profilerEndMs) >= 0)
+  {
+    _profilerStop();
+  }
+}
+#endif
+
+/* MQTT traffic capture */
+void _captureStop(void)
+{
+#if !defined(OXRS_32_DISABLE_REST_API)
+  if (_captureMode == CAPTURE_MODE_FILE) { _captureFile.close(); }
+#endif
+
+  if (_captureMode != CAPTURE_MODE_OFF)
+  {
+    _logger.print(F("[esp32] capture stopped, messages: "));
+    _logger.println(_captureMessages);
+  }
+
+  _captureMode = CAPTURE_MODE_OFF;
+}
+
+void _captureStart(const char * mode)
+{
+  _captureStop();
+
+  _captureMessages = 0;
+  _captureBytes = 0;
+
+  if (strcmp(mode, "serial") == 0)
+  {
+    _captureMode = CAPTURE_MODE_SERIAL;
+  }
+#if !defined(OXRS_32_DISABLE_REST_API)
+  else if (strcmp(mode, "file") == 0)
+  {
+    // Each capture replaces the last
+    _captureFile = LittleFS.open(CAPTURE_FILE, "w");
+    if (!_captureFile)
+    {
+      _logger.println(F("[esp32] failed to open capture file"));
+      return;
+    }
+    _captureMode = CAPTURE_MODE_FILE;
+  }
+#endif
+  else
+  {
+    return;
+  }
+
+  _logger.print(F("[esp32] capture started: "));
+  _logger.println(mode);
+}
+
+void _captureMessage(const char * topic, const byte * payload, int length)
+{
+  if (_captureMode == CAPTURE_MODE_OFF) { return; }
+
+  char header[48];
+  int topicLength = strlen(topic);
+  int headerLength = sprintf_P(header, PSTR("CAP %lu %d %d "), millis(), topicLength, length);
+
+  // Serial goes direct, not via the logger, which would publish to MQTT
+  Print * out = &Serial;
+#if !defined(OXRS_32_DISABLE_REST_API)
+  if (_captureMode == CAPTURE_MODE_FILE)
+  {
+    // Stop once the file is full rather than wrapping
+    if (_captureBytes + headerLength + topicLength + length + 1 > CAPTURE_MAX_BYTES)
+    {
+      _captureStop();
+      return;
+    }
+    out = &_captureFile;
+  }
+#endif
+
+  out->write((const uint8_t *)header, headerLength);
+  out->write((const uint8_t *)topic, topicLength);
+  out->write(payload, length);
+  out->write('\n');
+
+  _captureMessages++;
+  _captureBytes += headerLength + topicLength + length + 1;
+}
+
+/* Asset partition */
+void _assetsInit(void)
+{
+  const esp_partition_t * partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, ASSETS_PARTITION_LABEL);
+  if (!partition) { return; }
+
+  // Mapped through the flash cache, so reads never copy into RAM
+  const void * mapped;
+  if (esp_partition_mmap(partition, 0, partition->size, SPI_FLASH_MMAP_DATA, &mapped, &_assetsHandle) != ESP_OK)
+  {
+    _logger.println(F("[esp32] failed to map asset partition"));
+    return;
+  }
+
+  const assetHeader_t * header = (const assetHeader_t *)mapped;
+  if (header->magic != ASSETS_MAGIC || header->count > (partition->size - sizeof(assetHeader_t)) / sizeof(assetEntry_t))
+  {
+    _logger.println(F("[esp32] invalid asset partition"));
+    spi_flash_munmap(_assetsHandle);
+    return;
+  }
+
+  _assets = (const uint8_t *)mapped;
+  _assetsSize = partition->size;
+
+  _logger.print(F("[esp32] asset partition mapped, assets: "));
+  _logger.println(header->count);
+}
+
+uint32_t _assetCount(void)
+{
+  return _assets ? ((const assetHeader_t *)_assets)->count : 0;
+}
+
+const assetEntry_t * _assetEntry(uint32_t index)
+{
+  return &((const assetEntry_t *)(_assets + sizeof(assetHeader_t)))[index];
+}
+
+const assetEntry_t * _assetFind(const char * name)
+{
+  for (uint32_t i = 0; i < _assetCount(); i++)
+  {
+    const assetEntry_t * entry = _assetEntry(i);
+    if (strncmp(entry->name, name, ASSETS_NAME_SIZE) == 0)
+    {
+      // Don't trust anything pointing outside the partition
+      if (entry->offset > _assetsSize || entry->length > _assetsSize - entry->offset) { return NULL; }
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+boolean _assetLookup(const char * name, asset_t * asset)
+{
+  // Embedded in the firmware takes precedence
+  for (uint8_t i = 0; i < _embeddedAssetCount; i++)
+  {
+    if (strcmp(_embeddedAssets[i].name, name) == 0)
+    {
+      *asset = _embeddedAssets[i];
+      return true;
+    }
+  }
+
+  const assetEntry_t * entry = _assetFind(name);
+  if (!entry) { return false; }
+
+  asset->name = entry->name;
+  asset->data = _assets + entry->offset;
+  asset->length = entry->length;
+  asset->flags = entry->flags;
+  return true;
+}
+
+void _getAssetFragmentsJson(JsonVariant json)
+{
+  // Assets named 'adopt.<key>.json' are added to the adoption info as
+  // <key>, linked straight to flash rather than copied into the document
+  char key[ASSETS_NAME_SIZE];
+  for (uint32_t i = 0; i < _assetCount(); i++)
+  {
+    const assetEntry_t * entry = _assetEntry(i);
+    if (entry->flags & ASSETS_FLAG_GZIP) { continue; }
+    if (strncmp(entry->name, "adopt.", 6) != 0) { continue; }
+
+    size_t nameLength = strnlen(entry->name, ASSETS_NAME_SIZE);
+    if (nameLength <= 11 || nameLength == ASSETS_NAME_SIZE || strcmp(&entry->name[nameLength - 5], ".json") != 0) { continue; }
+    if (!_assetFind(entry->name)) { continue; }
+
+    memcpy(key, &entry->name[6], nameLength - 11);
+    key[nameLength - 11] = 0;
+
+    json[key] = serialized((const char *)(_assets + entry->offset), entry->length);
+  }
+}
+
+/* MQTT retry window */
+void _retryPop(void)
+{
+  _retryHead = (_retryHead + 1) % MQTT_RETRY_WINDOW_SIZE;
+  _retryCount--;
+}
+
+void _retryEnqueue(JsonVariant json)
+{
+  // Anything which won't fit in a slot is lost
+  if (measureJson(json) >= MQTT_RETRY_PAYLOAD_SIZE)
+  {
+    _retryDropped++;
+    _logger.println(F("[esp32] status payload too large to queue for retry"));
+    return;
+  }
+
+  // If the window is full drop the oldest message, it is the most stale
+  if (_retryCount == MQTT_RETRY_WINDOW_SIZE)
+  {
+    _retryPop();
+    _retryDropped++;
+  }
+
+  retrySlot_t * slot = &_retryWindow[(_retryHead + _retryCount) % MQTT_RETRY_WINDOW_SIZE];
+  serializeJson(json, slot->payload);
+  slot->attempts = 0;
+  slot->lastAttemptMs = millis();
+
+  _retryCount++;
+  _retryQueued++;
+}
+
+void _retryFlush(void)
+{
+  if (_retryCount == 0 || !_mqttClient.connected()) { return; }
+
+  // Only the oldest message is rate limited, once that goes through
+  // the connection is good so send everything else straight away
+  if ((millis() - _retryWindow[_retryHead].lastAttemptMs) < MQTT_RETRY_INTERVAL_MS) { return; }
+
+  char topic[64];
+  _mqtt.getStatusTopic(topic);
+
+  while (_retryCount > 0)
+  {
+    retrySlot_t * slot = &_retryWindow[_retryHead];
+    slot->lastAttemptMs = millis();
+
+    if (_mqttClient.publish(topic, slot->payload))
+    {
+      _retryPop();
+      _retrySent++;
+    }
+    else
+    {
+      if (++slot->attempts >= MQTT_RETRY_MAX_ATTEMPTS)
+      {
+        _retryPop();
+        _retryDropped++;
+      }
+      return;
+    }
+  }
+}
+
+/* MQTT publish accounting */
+void _countPublish(const char * topic, JsonVariant json)
+{
+  // Topic is sent as a 2 byte length prefix plus the string itself
+  _publishCount++;
+  _publishTopicBytes += strlen(topic) + 2;
+  _publishPayloadBytes += measureJson(json);
+}
+
+/* Message stamping */
+void _stampingStartSntp(void)
+{
+  // Needs the network stack, we start it from begin() if not up yet
+  if (WiFi.getMode() == WIFI_MODE_NULL) { return; }
+
+  if (sntp_enabled()) { sntp_stop(); }
+  sntp_setoperatingmode(SNTP_OPMODE_POLL);
+  sntp_setservername(0, _stampingNtpServer);
+  sntp_init();
+}
+
+boolean _timeSynced(void)
+{
+  // SNTP sets the clock some time after 2020, until then it is near 1970
+  return time(NULL) > 1577836800;
+}
+
+void _stampMessage(JsonVariant json, uint32_t * seq)
+{
+  if (!_stampingEnabled) { return; }
+
+  json["seq"] = ++(*seq);
+
+  if (_timeSynced())
+  {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+
+    // Never go backwards, even if SNTP steps the clock
+    uint64_t nowMs = (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+    if (nowMs < _lastStampMs) { nowMs = _lastStampMs; }
+    _lastStampMs = nowMs;
+
+    json["ts"] = nowMs;
+  }
+}
+
+/* MQTT buffer sizing */
+size_t _mqttPacketSize(const char * topic, size_t length)
+{
+  // Fixed header (max 5 bytes) + topic length prefix + topic + payload
+  return 5 + 2 + strlen(topic) + length;
+}
+
+void _mqttResizeBuffer(size_t required)
+{
+  // Size for the larger of what we need to send and the biggest
+  // message we have received so far, rounded up to limit churn
+  size_t size = max(required, (size_t)_mqttInboundHighWater);
+  size = max(size, (size_t)_mqttBufferFloor);
+  size = (size + 63) & ~63;
+
+  if (size == _mqttClient.getBufferSize()) { return; }
+
+  // The payload passed to our callback points into this buffer
+  if (_inMqttCallback) { return; }
+
+  if (_mqttClient.setBufferSize(size))
+  {
+    _mqttBufferResizes++;
+  }
+  else
+  {
+    _logger.print(F("[esp32] failed to resize mqtt buffer to "));
+    _logger.println(size);
+  }
+}
+
+void _mqttEnsureBuffer(const char * topic, JsonVariant json)
+{
+  size_t required = _mqttPacketSize(topic, measureJson(json));
+  if (required > _mqttOutboundHighWater) { _mqttOutboundHighWater = required; }
+
+  // Only grow here, we shrink back on (re)connect
+  if (required > _mqttClient.getBufferSize())
+  {
+    _mqttResizeBuffer(required);
+  }
+}
+
+/* Publishing - used for firmware and library messages alike */
+boolean _publishStatus(JsonVariant json)
+{
+  // Publish immediately unless there are older messages still waiting
+  // to be retried, in which case queue behind them to preserve order
+  _stampMessage(json, &_statusSeq);
+
+  char topic[64];
+  _mqtt.getStatusTopic(topic);
+  _mqttEnsureBuffer(topic, json);
+
+  if (_retryCount == 0 && WiFi.status() == WL_CONNECTED && _mqtt.publishStatus(json))
+  {
+    _countPublish(topic, json);
+    return true;
+  }
+
+  _retryEnqueue(json);
+  return false;
+}
+
+boolean _publishTelemetry(JsonVariant json)
+{
+  // Exit early if no network connection
+  if (WiFi.status() != WL_CONNECTED) { return false; }
+
+  _stampMessage(json, &_telemetrySeq);
+
+  char topic[64];
+  _mqtt.getTelemetryTopic(topic);
+  _mqttEnsureBuffer(topic, json);
+
+  if (!_mqtt.publishTelemetry(json)) { return false; }
+
+  _countPublish(topic, json);
+  return true;
+}
+
+/* Network self test */
+void _getSelfTestJson(JsonVariant json)
+{
+  JsonObject selfTest = json.createNestedObject("selfTest");
+  selfTest["rssi"] = WiFi.RSSI();
+
+  JsonObject broker = selfTest.createNestedObject("broker");
+  broker["samples"] = _selfTestSamples;
+  broker["failures"] = _selfTestFailures;
+  if (_selfTestSamples > _selfTestFailures)
+  {
+    broker["minConnectMs"] = _selfTestMinMs;
+    broker["avgConnectMs"] = _selfTestTotalMs / (_selfTestSamples - _selfTestFailures);
+    broker["maxConnectMs"] = _selfTestMaxMs;
+  }
+
+  JsonObject rest = selfTest.createNestedObject("rest");
+  rest["downloadBytesPerSecond"] = _selfTestDownloadBps;
+  rest["uploadBytesPerSecond"] = _selfTestUploadBps;
+}
+
+void _selfTestStart(void)
+{
+  // Test against whichever broker we are connected to right now
+  if (!_client.connected()) { return; }
+
+  // Via our socket, fd() is always -1 under TLS
+  int fd = _client.socketFd();
+  if (fd < 0) { return; }
+
+  _selfTestIp = _client.remoteIP(fd);
+  _selfTestPort = _client.remotePort(fd);
+  _selfTestRemaining = SELFTEST_SAMPLES;
+  _selfTestSamples = 0;
+  _selfTestFailures = 0;
+  _selfTestTotalMs = 0;
+  _selfTestMinMs = UINT32_MAX;
+  _selfTestMaxMs = 0;
+
+  _logger.println(F("[esp32] network self test started"));
+}
+
+void _selfTestLoop(void)
+{
+  if (_selfTestRemaining == 0) { return; }
+
+  // One connection per call, each bounded by the timeout
+  WiFiClient client;
+  uint32_t start = millis();
+  boolean success = client.connect(_selfTestIp, _selfTestPort, SELFTEST_TIMEOUT_MS);
+  uint32_t elapsed = millis() - start;
+  client.stop();
+
+  _selfTestSamples++;
+  if (success)
+  {
+    _selfTestTotalMs += elapsed;
+    if (elapsed < _selfTestMinMs) { _selfTestMinMs = elapsed; }
+    if (elapsed > _selfTestMaxMs) { _selfTestMaxMs = elapsed; }
+  }
+  else
+  {
+    _selfTestFailures++;
+  }
+
+  // All done, publish the results
+  if (--_selfTestRemaining == 0)
+  {
+    DynamicJsonDocument json(512);
+    _getSelfTestJson(json.as<JsonVariant>());
+    _publishTelemetry(json.as<JsonVariant>());
+
+    _logger.println(F("[esp32] network self test complete"));
+  }
+}
+
+/* DNS cache */
+void _dnsInit(void)
+{
+  // Anything other than a warm restart leaves RTC memory as garbage
+  if (_dnsCacheMagic != DNS_CACHE_MAGIC)
+  {
+    memset(_dnsCache, 0, sizeof(_dnsCache));
+    _dnsCacheMagic = DNS_CACHE_MAGIC;
+    return;
+  }
+
+  // Keep the addresses, but we have no idea how old they are now
+  for (uint8_t i = 0; i < DNS_CACHE_SIZE; i++)
+  {
+    _dnsCache[i].host[sizeof(_dnsCache[i].host) - 1] = 0;
+    _dnsCache[i].fresh = false;
+    _dnsCache[i].revalidate = false;
+  }
+}
+
+boolean _dnsUpdate(dnsEntry_t * entry, uint32_t start, boolean success, uint32_t ip)
+{
+  _dnsLastResolveMs = millis() - start;
+  if (_dnsLastResolveMs > _dnsMaxResolveMs) { _dnsMaxResolveMs = _dnsLastResolveMs; }
+
+  if (!success)
+  {
+    _dnsFailures++;
+    return false;
+  }
+
+  entry->ip = ip;
+  entry->resolvedMs = millis();
+  entry->fresh = true;
+  entry->revalidate = false;
+  return true;
+}
+
+boolean _dnsLookup(dnsEntry_t * entry)
+{
+  uint32_t start = millis();
+
+  IPAddress ip;
+  boolean success = WiFi.hostByName(entry->host, ip);
+
+  return _dnsUpdate(entry, start, success, (uint32_t)ip);
+}
+
+void _dnsFound(const char * name, const ip_addr_t * ipaddr, void * arg)
+{
+  // Runs in the lwIP task, just hand the result over to loop()
+  if (ipaddr) { _dnsPendingIp = ip_2_ip4(ipaddr)->addr; }
+  _dnsPendingSuccess = ipaddr != NULL;
+  _dnsPendingDone = true;
+}
+
+boolean _dnsResolve(const char * host, IPAddress & ip)
+{
+  // Nothing to do for IP literals
+  if (ip.fromString(host)) { return true; }
+
+  // Find the cache entry for this host, or an empty one to fill
+  // (hostnames too long for an entry are never cached)
+  dnsEntry_t * entry = NULL;
+  boolean cacheable = strlen(host) < sizeof(_dnsCache[0].host);
+  for (uint8_t i = 0; cacheable && i < DNS_CACHE_SIZE; i++)
+  {
+    if (strcmp(_dnsCache[i].host, host) == 0) { entry = &_dnsCache[i]; break; }
+    if (!entry && _dnsCache[i].host[0] == 0) { entry = &_dnsCache[i]; }
+  }
+
+  // Cache full (more hostnames than brokers?) or hostname too long,
+  // resolve without caching
+  if (!entry)
+  {
+    _dnsMisses++;
+    return WiFi.hostByName(host, ip);
+  }
+
+  // Expire entries which have passed their TTL
+  if (entry->fresh && (millis() - entry->resolvedMs) > DNS_CACHE_TTL_MS)
+  {
+    entry->fresh = false;
+  }
+
+  if (entry->fresh)
+  {
+    _dnsHits++;
+  }
+  else if (entry->ip != 0)
+  {
+    // Stale while revalidate - use what we have and refresh from loop()
+    _dnsStaleHits++;
+    entry->revalidate = true;
+  }
+  else
+  {
+    _dnsMisses++;
+    strcpy(entry->host, host);
+    if (!_dnsLookup(entry))
+    {
+      entry->host[0] = 0;
+      return false;
+    }
+  }
+
+  ip = IPAddress(entry->ip);
+  return true;
+}
+
+void _dnsRevalidate(void)
+{
+  // Never blocks, one stale entry at a time is looked up in the
+  // background and picked up here once lwIP calls us back
+  // NOTE: on failure we keep serving the stale address until the next
+  //       attempt, lwIP always calls back (with NULL on timeout)
+  if (_dnsPending != -1)
+  {
+    if (!_dnsPendingDone) { return; }
+
+    dnsEntry_t * entry = &_dnsCache[_dnsPending];
+    _dnsPending = -1;
+
+    if (!_dnsUpdate(entry, _dnsPendingStartMs, _dnsPendingSuccess, _dnsPendingIp))
+    {
+      entry->revalidate = false;
+    }
+    return;
+  }
+
+  for (uint8_t i = 0; i < DNS_CACHE_SIZE; i++)
+  {
+    dnsEntry_t * entry = &_dnsCache[i];
+    if (!entry->revalidate) { continue; }
+
+    _dnsPendingStartMs = millis();
+    _dnsPendingDone = false;
+
+    ip_addr_t addr;
+    ip_addr_set_zero(&addr);
+    err_t err = dns_gethostbyname(entry->host, &addr, _dnsFound, NULL);
+    if (err == ERR_INPROGRESS)
+    {
+      _dnsPending = i;
+      return;
+    }
+
+    // Answered straight from lwIP's own cache, or failed outright
+    if (!_dnsUpdate(entry, _dnsPendingStartMs, err == ERR_OK, ip_2_ip4(&addr)->addr))
+    {
+      entry->revalidate = false;
+    }
+    return;
+  }
+}
+
+/* MQTT broker failover */
+broker_t * _brokerGet(int8_t index)
+{
+  return index == -1 ? &_brokerConfigured : &_brokers[index];
+}
+
+uint32_t _brokerScore(broker_t * broker)
+{
+  // Lower is better - brokers we have never connected to score 0 so
+  // they get tried before any which have failed recently
+  return (broker->failures * MQTT_BROKER_PENALTY_MS) + broker->connectMs;
+}
+
+void _brokerApply(void)
+{
+  broker_t * broker = _brokerGet(_brokerActive);
+  _mqtt.setBroker(broker->host, broker->port);
+}
+
+void _brokerSelect(void)
+{
+  int8_t best = -2;
+  for (int8_t i = -1; i < _brokerCount; i++)
+  {
+    // Don't pick the one which just failed
+    if (i == _brokerActive) { continue; }
+    if (_brokerGet(i)->host[0] == 0) { continue; }
+
+    if (best == -2 || _brokerScore(_brokerGet(i)) < _brokerScore(_brokerGet(best)))
+    {
+      best = i;
+    }
+  }
+
+  if (best == -2) { return; }
+
+  _brokerActive = best;
+  _brokerFailovers++;
+  _brokerProbeMs = millis();
+  _brokerApply();
+
+  _logger.print(F("[esp32] mqtt failing over to "));
+  _logger.print(_brokerGet(best)->host);
+  _logger.print(F(":"));
+  _logger.println(_brokerGet(best)->port);
+}
+
+void _brokerConnecting(const char * host, uint16_t port)
+{
+  broker_t * active = _brokerGet(_brokerActive);
+  if (active->port == port && strcmp(active->host, host) == 0) { return; }
+
+  // Anything other than the broker we picked came from the API (at boot,
+  // or reconfigured since), so that is now our configured broker
+  if (strlen(host) >= sizeof(_brokerConfigured.host)) { return; }
+
+  strcpy(_brokerConfigured.host, host);
+  _brokerConfigured.port = port;
+  _brokerConfigured.failures = 0;
+  _brokerConfigured.connectMs = 0;
+  _brokerActive = -1;
+}
+
+void _brokerConnected(void)
+{
+  // Transport (TCP + TLS) setup time of this connection, which unlike
+  // wall clock time since the last attempt excludes any reconnect
+  // backoff in the MQTT library
+  broker_t * broker = _brokerGet(_brokerActive);
+  broker->failures = 0;
+  broker->connectMs = _transportLastMs;
+}
+
+void _brokerDisconnected(int state)
+{
+  // Lost an established connection, nothing to hold against the broker
+  if (state == MQTT_CONNECTION_LOST || state == MQTT_DISCONNECTED) { return; }
+
+  // Any other state is a failed connection attempt
+  broker_t * broker = _brokerGet(_brokerActive);
+  if (broker->failures < 255) { broker->failures++; }
 
-// Network client (for MQTT)/server (for REST API)
-WiFiClient _client;
-WiFiServer _server(REST_API_PORT);
+  if (broker->failures >= MQTT_BROKER_MAX_FAILURES)
+  {
+    _brokerSelect();
+  }
+}
 
-// MQTT client
-PubSubClient _mqttClient(_client);
-OXRS_MQTT _mqtt(_mqttClient);
+void _brokerFailback(void)
+{
+  // Only while we are happily connected to a failover broker
+  if (_brokerActive == -1 || _brokerConfigured.host[0] == 0 || !_mqttClient.connected()) { return; }
+  if ((millis() - _brokerProbeMs) < MQTT_BROKER_FAILBACK_MS) { return; }
+  _brokerProbeMs = millis();
 
-// REST API
-OXRS_API _api(_mqtt);
+  // Check the configured broker accepts connections again before
+  // dropping the one we have
+  IPAddress ip;
+  if (!_dnsResolve(_brokerConfigured.host, ip)) { return; }
 
-// Logging (topic updated once MQTT connects successfully)
-MqttLogger _logger(_mqttClient, "log", MqttLoggerMode::MqttAndSerial);
+  WiFiClient probe;
+  boolean success = probe.connect(ip, _brokerConfigured.port, MQTT_BROKER_PROBE_TIMEOUT_MS);
+  probe.stop();
+  if (!success) { return; }
 
-// Supported firmware config and command schemas
-DynamicJsonDocument _fwConfigSchema(JSON_CONFIG_MAX_SIZE);
-DynamicJsonDocument _fwCommandSchema(JSON_COMMAND_MAX_SIZE);
+  _logger.print(F("[esp32] mqtt failing back to "));
+  _logger.print(_brokerConfigured.host);
+  _logger.print(F(":"));
+  _logger.println(_brokerConfigured.port);
 
-// MQTT callbacks wrapped by _mqttConfig/_mqttCommand
-jsonCallback _onConfig;
-jsonCallback _onCommand;
+  _brokerActive = -1;
+  _brokerConfigured.failures = 0;
+  _brokerFailbacks++;
+  _brokerApply();
 
-/* JSON helpers */
-void _mergeJson(JsonVariant dst, JsonVariantConst src)
+  // The MQTT library reconnects (to the configured broker) from loop()
+  _mqttClient.disconnect();
+}
+
+int MqttNetworkClient::connect(const char * host, uint16_t port)
 {
-  if (src.is<JsonObjectConst>())
-  {
-    for (JsonPairConst kvp : src.as<JsonObjectConst>())
-    {
-      if (dst[kvp.key()])
-      {
-        _mergeJson(dst[kvp.key()], kvp.value());
-      }
-      else
-      {
-        dst[kvp.key()] = kvp.value();
-      }
-    }
-  }
-  else
+  // Every broker hostname (configured or failover) comes through here
+  _brokerConnecting(host, port);
+
+  // Reconnects use our cached address rather than a fresh lookup
+  IPAddress ip;
+  if (!_dnsResolve(host, ip))
   {
-    dst.set(src);
+    _logger.print(F("[esp32] failed to resolve mqtt broker "));
+    _logger.println(host);
+    return 0;
   }
+
+#if defined(OXRS_32_MQTT_TLS)
+  // Connect to the cached address, but send SNI and verify the broker
+  // certificate against the hostname, not the address
+  uint32_t start = millis();
+  int result = mqttNetworkClient_t::connect(ip, port, host, _CA_cert, _cert, _private_key);
+  _transportConnected(start, result);
+  return result;
+#else
+  return connect(ip, port);
+#endif
 }
 
 /* Adoption info builders */
@@ -86,8 +1559,10 @@ void _getSystemJson(JsonVariant json)
   system["sketchSpaceUsedBytes"] = ESP.getSketchSize();
   system["sketchSpaceTotalBytes"] = ESP.getFreeSketchSpace();
 
+#if !defined(OXRS_32_DISABLE_REST_API)
   system["fileSystemUsedBytes"] = LittleFS.usedBytes();
   system["fileSystemTotalBytes"] = LittleFS.totalBytes();
+#endif
 }
 
 void _getNetworkJson(JsonVariant json)
@@ -103,6 +1578,14 @@ void _getNetworkJson(JsonVariant json)
   char mac_display[18];
   sprintf_P(mac_display, PSTR("%02X:%02X:%02X:%02X:%02X:%02X"), mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
   network["mac"] = mac_display;
+
+  // Only known once the MQTT library has tried to connect
+  broker_t * broker = _brokerGet(_brokerActive);
+  if (broker->host[0] != 0)
+  {
+    network["mqttBroker"] = broker->host;
+    network["mqttPort"] = broker->port;
+  }
 }
 
 void _getConfigSchemaJson(JsonVariant json)
@@ -121,6 +1604,16 @@ void _getConfigSchemaJson(JsonVariant json)
   {
     _mergeJson(properties, _fwConfigSchema.as<JsonVariant>());
   }
+
+  // Generic config
+  JsonObject wifiProfile = properties.createNestedObject("wifiProfile");
+  wifiProfile["title"] = "WiFi Profile";
+  wifiProfile["description"] = "Trade off command latency against power usage (defaults to SDK settings).";
+  JsonArray wifiProfileEnum = wifiProfile.createNestedArray("enum");
+  for (uint8_t i = 0; i < sizeof(_wifiProfiles) / sizeof(_wifiProfiles[0]); i++)
+  {
+    wifiProfileEnum.add(_wifiProfiles[i].name);
+  }
 }
 
 void _getCommandSchemaJson(JsonVariant json)
@@ -132,45 +1625,633 @@ void _getCommandSchemaJson(JsonVariant json)
   commandSchema["title"] = FW_SHORT_NAME;
   commandSchema["type"] = "object";
 
-  JsonObject properties = commandSchema.createNestedObject("properties");
+  JsonObject properties = commandSchema.createNestedObject("properties");
+
+  // Firmware command schema (if any)
+  if (!_fwCommandSchema.isNull())
+  {
+    _mergeJson(properties, _fwCommandSchema.as<JsonVariant>());
+  }
+
+  // Generic commands
+  JsonObject restart = properties.createNestedObject("restart");
+  restart["title"] = "Restart";
+  restart["type"] = "boolean";
+
+  JsonObject stats = properties.createNestedObject("stats");
+  stats["title"] = "Publish Stats";
+  stats["type"] = "boolean";
+
+  JsonObject benchAdopt = properties.createNestedObject("benchAdopt");
+  benchAdopt["title"] = "Benchmark Adoption";
+  benchAdopt["description"] = "Build the adoption info this many times and publish per builder timings to tele/.";
+  benchAdopt["type"] = "integer";
+  benchAdopt["minimum"] = 1;
+  benchAdopt["maximum"] = ADOPT_BENCH_MAX_ITERATIONS;
+
+  JsonObject selfTest = properties.createNestedObject("selfTest");
+  selfTest["title"] = "Network Self Test";
+  selfTest["description"] = "Measure TCP connect latency to the broker and publish the results (with any REST throughput measured via /selftest) to tele/.";
+  selfTest["type"] = "boolean";
+
+  JsonObject ping = properties.createNestedObject("ping");
+  ping["title"] = "Ping";
+  ping["description"] = "Echoed straight back as 'pong' on stat/, for measuring command latency.";
+  ping["type"] = "integer";
+
+  JsonObject capture = properties.createNestedObject("capture");
+  capture["title"] = "Capture MQTT Traffic";
+  capture["description"] = "Record inbound MQTT messages for replay (file captures available at GET /capture).";
+  JsonArray captureEnum = capture.createNestedArray("enum");
+  captureEnum.add("off");
+  captureEnum.add("serial");
+#if !defined(OXRS_32_DISABLE_REST_API)
+  captureEnum.add("file");
+#endif
+
+#if !defined(OXRS_32_DISABLE_REST_API) && defined(__XTENSA__)
+  JsonObject profile = properties.createNestedObject("profile");
+  profile["title"] = "Run Profiler";
+  profile["description"] = "Sample the program counter for this many seconds, results available at GET /profile for symbolising against the firmware ELF.";
+  profile["type"] = "integer";
+  profile["minimum"] = 1;
+  profile["maximum"] = PROFILER_MAX_SECONDS;
+#endif
+}
+
+void _getAdoptTimingJson(JsonVariant json)
+{
+  JsonObject adoptBuilders = json.createNestedObject("adoptBuilders");
+
+  for (uint8_t i = 0; i < ADOPT_BUILDERS; i++)
+  {
+    adoptTiming_t * timing = &_adoptTiming[i];
+    if (timing->calls == 0) { continue; }
+
+    JsonObject builder = adoptBuilders.createNestedObject(_adoptBuilderNames[i]);
+    builder["calls"] = timing->calls;
+    builder["avgUs"] = timing->totalUs / timing->calls;
+    builder["maxUs"] = timing->maxUs;
+    builder["memoryBytes"] = timing->memoryBytes;
+    builder["outputBytes"] = timing->outputBytes;
+  }
+}
+
+void _getBrokerJson(JsonObject json, broker_t * broker)
+{
+  json["host"] = broker->host;
+  json["port"] = broker->port;
+  json["failures"] = broker->failures;
+  json["connectMs"] = broker->connectMs;
+}
+
+void _getStatsJson(JsonVariant json)
+{
+  JsonObject stats = json.createNestedObject("stats");
+
+  _getBootJson(stats);
+
+  JsonObject mqttRetry = stats.createNestedObject("mqttRetry");
+  mqttRetry["pending"] = _retryCount;
+  mqttRetry["queued"] = _retryQueued;
+  mqttRetry["sent"] = _retrySent;
+  mqttRetry["dropped"] = _retryDropped;
+
+  JsonObject mqttPublish = stats.createNestedObject("mqttPublish");
+  mqttPublish["messages"] = _publishCount;
+  mqttPublish["topicBytes"] = _publishTopicBytes;
+  mqttPublish["payloadBytes"] = _publishPayloadBytes;
+
+  JsonObject mqttBuffer = stats.createNestedObject("mqttBuffer");
+  mqttBuffer["sizeBytes"] = _mqttClient.getBufferSize();
+  mqttBuffer["floorBytes"] = _mqttBufferFloor;
+  mqttBuffer["inboundHighWaterBytes"] = _mqttInboundHighWater;
+  mqttBuffer["outboundHighWaterBytes"] = _mqttOutboundHighWater;
+  mqttBuffer["resizes"] = _mqttBufferResizes;
+
+  if (_stampingEnabled)
+  {
+    JsonObject stamping = stats.createNestedObject("messageStamping");
+    stamping["timeSynced"] = _timeSynced();
+    stamping["statusSeq"] = _statusSeq;
+    stamping["telemetrySeq"] = _telemetrySeq;
+  }
+
+  if (_wifiProfile != -1)
+  {
+    JsonObject wifi = stats.createNestedObject("wifi");
+    wifi["profile"] = _wifiProfiles[_wifiProfile].name;
+    wifi["rssi"] = WiFi.RSSI();
+  }
+
+  _getGovernorJson(stats);
+  _getIdleSleepJson(stats);
+
+  if (_configStreaming)
+  {
+    JsonObject configStream = stats.createNestedObject("configStreaming");
+    configStream["fragments"] = _configFragments;
+    configStream["maxFragmentBytes"] = _configFragmentMaxBytes;
+  }
+
+  JsonObject heap = stats.createNestedObject("heap");
+  heap["freeBytes"] = ESP.getFreeHeap();
+  heap["minFreeBytes"] = ESP.getMinFreeHeap();
+  heap["maxAllocBytes"] = ESP.getMaxAllocHeap();
+
+  JsonObject mqttReceive = stats.createNestedObject("mqttReceive");
+  mqttReceive["dispatches"] = _rxDispatches;
+  mqttReceive["maxDispatchUs"] = _rxDispatchMaxUs;
+  mqttReceive["totalDispatchUs"] = _rxDispatchTotalUs;
+  if (_rxDispatches > 0)
+  {
+    mqttReceive["avgDispatchUs"] = _rxDispatchTotalUs / _rxDispatches;
+  }
+  if (_rxDeferred)
+  {
+    mqttReceive["queued"] = _rxQueued;
+    mqttReceive["inline"] = _rxInline;
+    mqttReceive["dropped"] = _rxDropped;
+    mqttReceive["depthHighWater"] = _rxDepthHighWater;
+    mqttReceive["maxWaitUs"] = _rxWaitMaxUs;
+    if (_rxQueued > 0)
+    {
+      mqttReceive["avgWaitUs"] = _rxWaitTotalUs / _rxQueued;
+    }
+  }
+
+  _getAdoptTimingJson(stats);
+
+  JsonObject handlers = stats.createNestedObject("handlers");
+  _getHandlerTimingJson(handlers, "config", &_configTiming);
+  _getHandlerTimingJson(handlers, "command", &_commandTiming);
+
+  if (_captureMode != CAPTURE_MODE_OFF)
+  {
+    JsonObject capture = stats.createNestedObject("capture");
+    capture["messages"] = _captureMessages;
+    capture["bytes"] = _captureBytes;
+  }
+
+  if (_otaBytes)
+  {
+    JsonObject ota = stats.createNestedObject("ota");
+    ota["bytes"] = _otaBytes;
+    ota["durationMs"] = _otaDurationMs;
+  }
+
+  JsonObject mqttTransport = stats.createNestedObject("mqttTransport");
+#if defined(OXRS_32_MQTT_TLS)
+  mqttTransport["tls"] = true;
+#else
+  mqttTransport["tls"] = false;
+#endif
+  mqttTransport["connects"] = _transportConnects;
+  mqttTransport["failures"] = _transportFailures;
+  mqttTransport["lastConnectMs"] = _transportLastMs;
+  if (_transportConnects > 0)
+  {
+    mqttTransport["minConnectMs"] = _transportMinMs;
+    mqttTransport["maxConnectMs"] = _transportMaxMs;
+  }
+
+  JsonObject dns = stats.createNestedObject("dns");
+  dns["hits"] = _dnsHits;
+  dns["staleHits"] = _dnsStaleHits;
+  dns["misses"] = _dnsMisses;
+  dns["failures"] = _dnsFailures;
+  dns["lastResolveMs"] = _dnsLastResolveMs;
+  dns["maxResolveMs"] = _dnsMaxResolveMs;
+
+  JsonObject mqttBrokers = stats.createNestedObject("mqttBrokers");
+  mqttBrokers["active"] = _brokerActive;
+  mqttBrokers["failovers"] = _brokerFailovers;
+  mqttBrokers["failbacks"] = _brokerFailbacks;
+  _getBrokerJson(mqttBrokers.createNestedObject("configured"), &_brokerConfigured);
+  JsonArray brokers = mqttBrokers.createNestedArray("brokers");
+  for (uint8_t i = 0; i < _brokerCount; i++)
+  {
+    _getBrokerJson(brokers.createNestedObject(), &_brokers[i]);
+  }
+}
+
+void _timeAdoptBuilder(uint8_t index, void (*builder)(JsonVariant), JsonVariant json)
+{
+  adoptTiming_t * timing = &_adoptTiming[index];
+
+  size_t memoryBefore = json.memoryUsage();
+  uint32_t start = micros();
+  builder(json);
+  uint32_t elapsed = micros() - start;
+
+  timing->calls++;
+  timing->totalUs += elapsed;
+  if (elapsed > timing->maxUs) { timing->maxUs = elapsed; }
+
+  // Document pool used and serialised size of what this builder added
+  timing->memoryBytes = json.memoryUsage() - memoryBefore;
+  timing->outputBytes = measureJson(json[_adoptBuilderNames[index]]);
+}
+
+/* API callbacks */
+// NOTE: none of these pump _mqttClient.loop() while streaming, a command
+//       handled mid-request could change the state being served (e.g.
+//       starting a capture truncates the file GET /capture is sending)
+void _apiAdopt(JsonVariant json)
+{
+  // Build device adoption info
+  _timeAdoptBuilder(0, _getFirmwareJson, json);
+  _timeAdoptBuilder(1, _getSystemJson, json);
+  _timeAdoptBuilder(2, _getNetworkJson, json);
+  _timeAdoptBuilder(3, _getConfigSchemaJson, json);
+  _timeAdoptBuilder(4, _getCommandSchemaJson, json);
+
+  // Static fragments from the asset partition (if any)
+  _getAssetFragmentsJson(json);
+}
+
+#if defined(OXRS_32_ENABLE_OTA) && !defined(OXRS_32_DISABLE_REST_API)
+void _apiOta(Request &req, Response &res)
+{
+  // Content-Length is required so we can size the update up front
+  uint32_t size = req.left();
+  if (size == 0)
+  {
+    res.status(411);
+    res.print(F("Content-Length required"));
+    return;
+  }
+
+  if (!Update.begin(size))
+  {
+    res.status(400);
+    res.print(Update.errorString());
+    return;
+  }
+
+  _logger.print(F("[esp32] ota update started, bytes: "));
+  _logger.println(size);
+
+  // Stream straight into the update partition a chunk at a time
+  uint8_t buffer[OTA_CHUNK_SIZE];
+  uint32_t start = millis();
+  uint32_t written = 0;
+
+  while (req.left() > 0)
+  {
+    int length = req.readBytes(buffer, min((uint32_t)req.left(), (uint32_t)sizeof(buffer)));
+    if (length <= 0) { break; }
+
+    if (Update.write(buffer, length) != (size_t)length) { break; }
+    written += length;
+
+    // NOTE: no _mqttClient.loop() here, commands handled mid-flash (e.g.
+    //       'restart') would run re-entrantly, and we restart after anyway
+  }
+
+  _otaBytes = written;
+  _otaDurationMs = millis() - start;
+
+  if (written != size || !Update.end())
+  {
+    Update.abort();
+
+    _logger.print(F("[esp32] ota update failed: "));
+    _logger.println(Update.errorString());
+
+    res.status(500);
+    res.print(Update.errorString());
+    return;
+  }
+
+  _logger.print(F("[esp32] ota update complete, ms: "));
+  _logger.println(_otaDurationMs);
+
+  DynamicJsonDocument json(128);
+  json["bytes"] = _otaBytes;
+  json["durationMs"] = _otaDurationMs;
+  json["bytesPerSecond"] = _otaDurationMs ? (uint32_t)((uint64_t)_otaBytes * 1000 / _otaDurationMs) : 0;
+
+  res.set("Content-Type", "application/json");
+  serializeJson(json, res);
+
+  // Restart from loop() once the response has gone
+  _otaRestartMs = millis();
+}
+#endif
+
+#if !defined(OXRS_32_DISABLE_REST_API) && defined(__XTENSA__)
+void _apiProfile(Request &req, Response &res)
+{
+  // Streamed rather than built in a document, it can be large
+  res.set("Content-Type", "application/json");
+  res.print(F("{\"running\":"));
+  res.print(_profilerTimer ? F("true") : F("false"));
+  res.print(F(",\"sampleHz\":"));
+  res.print(PROFILER_SAMPLE_HZ);
+  res.print(F(",\"samples\":"));
+  res.print(_profilerSamples);
+  res.print(F(",\"dropped\":"));
+  res.print(_profilerDropped);
+  res.print(F(",\"pcs\":{"));
+
+  if (_profilerBuckets && !_profilerTimer)
+  {
+    boolean first = true;
+    char pc[16];
+    for (uint16_t i = 0; i < PROFILER_BUCKETS; i++)
+    {
+      if (_profilerBuckets[i].count == 0) { continue; }
+
+      sprintf_P(pc, PSTR("\"0x%08x\":"), _profilerBuckets[i].pc);
+      if (!first) { res.print(','); }
+      res.print(pc);
+      res.print(_profilerBuckets[i].count);
+      first = false;
+    }
+  }
+
+  res.print(F("}}"));
+}
+#endif
+
+#if !defined(OXRS_32_DISABLE_REST_API)
+void _apiStreamFile(Response &res, const char * path)
+{
+  File file = LittleFS.open(path, "r");
+  if (!file)
+  {
+    res.sendStatus(404);
+    return;
+  }
+
+  res.set("Content-Type", "application/octet-stream");
+
+  // Constant memory regardless of file size
+  uint8_t buffer[FILES_CHUNK_SIZE];
+  while (file.available())
+  {
+    size_t length = file.read(buffer, sizeof(buffer));
+    res.write(buffer, length);
+  }
+
+  file.close();
+}
+
+void _apiCapture(Request &req, Response &res)
+{
+  // Can't read it while it is still being written
+  if (_captureMode == CAPTURE_MODE_FILE) { _captureStop(); }
+
+  _apiStreamFile(res, CAPTURE_FILE);
+}
+
+boolean _apiFilePath(Request &req, char * path, size_t size)
+{
+  char name[FILES_NAME_SIZE];
+  if (!req.route("name", name, sizeof(name))) { return false; }
+
+  // Flat names only, no hidden files, and nothing clashing with uploads in progress
+  if (name[0] == 0 || name[0] == '.' || strchr(name, '/')) { return false; }
+  size_t length = strlen(name);
+  if (length >= 4 && strcmp(&name[length - 4], ".tmp") == 0) { return false; }
+
+  // Kept out of the root, where the REST API stores its settings
+  snprintf(path, size, FILES_DIR "/%s", name);
+  return true;
+}
+
+void _apiFileDownload(Request &req, Response &res)
+{
+  char path[sizeof(FILES_DIR) + FILES_NAME_SIZE];
+  if (!_apiFilePath(req, path, sizeof(path)))
+  {
+    res.sendStatus(400);
+    return;
+  }
+
+  _apiStreamFile(res, path);
+}
+
+void _apiFileUpload(Request &req, Response &res)
+{
+  char path[sizeof(FILES_DIR) + FILES_NAME_SIZE];
+  if (!_apiFilePath(req, path, sizeof(path)))
+  {
+    res.sendStatus(400);
+    return;
+  }
+
+  // Content-Length is required, otherwise we'd replace the file with
+  // an empty one
+  uint32_t size = req.left();
+  if (size == 0)
+  {
+    res.sendStatus(411);
+    return;
+  }
+
+  if (size > LittleFS.totalBytes() - LittleFS.usedBytes())
+  {
+    res.sendStatus(413);
+    return;
+  }
+
+  if (!LittleFS.exists(FILES_DIR)) { LittleFS.mkdir(FILES_DIR); }
+
+  // Write to a temp file and only replace the real one once complete
+  char tmpPath[sizeof(FILES_DIR) + FILES_NAME_SIZE + 4];
+  snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+
+  File file = LittleFS.open(tmpPath, "w");
+  if (!file)
+  {
+    res.sendStatus(500);
+    return;
+  }
+
+  uint8_t buffer[FILES_CHUNK_SIZE];
+  uint32_t start = millis();
+  uint32_t written = 0;
+
+  while (req.left() > 0)
+  {
+    int length = req.readBytes(buffer, min((uint32_t)req.left(), (uint32_t)sizeof(buffer)));
+    if (length <= 0) { break; }
+
+    if (file.write(buffer, length) != (size_t)length) { break; }
+    written += length;
+  }
+
+  file.close();
+  uint32_t durationMs = millis() - start;
+
+  // LittleFS rename replaces any existing file atomically
+  if (written != size || !LittleFS.rename(tmpPath, path))
+  {
+    LittleFS.remove(tmpPath);
+    res.sendStatus(500);
+    return;
+  }
+
+  _logger.print(F("[esp32] file uploaded: "));
+  _logger.println(path);
+
+  DynamicJsonDocument json(128);
+  json["bytes"] = written;
+  json["durationMs"] = durationMs;
+  json["bytesPerSecond"] = durationMs ? (uint32_t)((uint64_t)written * 1000 / durationMs) : 0;
+
+  res.set("Content-Type", "application/json");
+  serializeJson(json, res);
+}
+#endif
+
+#if !defined(OXRS_32_DISABLE_REST_API)
+const char * _assetContentType(const char * name)
+{
+  const char * extension = strrchr(name, '.');
+  if (!extension) { return "application/octet-stream"; }
+
+  if (strcmp(extension, ".html") == 0) { return "text/html"; }
+  if (strcmp(extension, ".css") == 0)  { return "text/css"; }
+  if (strcmp(extension, ".js") == 0)   { return "application/javascript"; }
+  if (strcmp(extension, ".json") == 0) { return "application/json"; }
+  if (strcmp(extension, ".svg") == 0)  { return "image/svg+xml"; }
+  if (strcmp(extension, ".png") == 0)  { return "image/png"; }
+  if (strcmp(extension, ".ico") == 0)  { return "image/x-icon"; }
+  return "application/octet-stream";
+}
+
+void _apiServeAsset(Response &res, const char * name)
+{
+  asset_t asset;
+  if (!_assetLookup(name, &asset))
+  {
+    res.sendStatus(404);
+    return;
+  }
+
+  res.set("Content-Type", _assetContentType(name));
+  res.set("Cache-Control", "max-age=" STRINGIFY(ASSETS_MAX_AGE));
+  if (asset.flags & ASSETS_FLAG_GZIP)
+  {
+    // Precompressed at build time, the browser does the rest
+    res.set("Content-Encoding", "gzip");
+  }
+
+  // Written in chunks straight from flash, no RAM copy
+  for (uint32_t sent = 0; sent < asset.length; sent += ASSETS_CHUNK_SIZE)
+  {
+    res.write((uint8_t *)(asset.data + sent), min(asset.length - sent, (uint32_t)ASSETS_CHUNK_SIZE));
+  }
+}
+
+void _apiAsset(Request &req, Response &res)
+{
+  char name[ASSETS_NAME_SIZE];
+  if (!req.route("name", name, sizeof(name)))
+  {
+    res.sendStatus(404);
+    return;
+  }
+
+  _apiServeAsset(res, name);
+}
+
+void _apiAssetIndex(Request &req, Response &res)
+{
+  _apiServeAsset(res, "index.html");
+}
+#endif
+
+#if !defined(OXRS_32_DISABLE_REST_API)
+void _apiSelfTestDownload(Request &req, Response &res)
+{
+  char bytes[16];
+  uint32_t size = 65536;
+  if (req.query("bytes", bytes, sizeof(bytes))) { size = min((uint32_t)atol(bytes), (uint32_t)SELFTEST_MAX_BYTES); }
+
+  res.set("Content-Type", "application/octet-stream");
 
-  // Firmware command schema (if any)
-  if (!_fwCommandSchema.isNull())
+  // Send filler in chunks, timing how long the client takes to accept it
+  uint8_t buffer[FILES_CHUNK_SIZE];
+  memset(buffer, 'x', sizeof(buffer));
+
+  uint32_t start = millis();
+  for (uint32_t sent = 0; sent < size; sent += sizeof(buffer))
   {
-    _mergeJson(properties, _fwCommandSchema.as<JsonVariant>());
+    res.write(buffer, min(size - sent, (uint32_t)sizeof(buffer)));
   }
+  res.flush();
 
-  // Generic commands
-  JsonObject restart = properties.createNestedObject("restart");
-  restart["title"] = "Restart";
-  restart["type"] = "boolean";
+  uint32_t elapsed = millis() - start;
+  _selfTestDownloadBps = elapsed ? (uint32_t)((uint64_t)size * 1000 / elapsed) : 0;
 }
 
-/* API callbacks */
-void _apiAdopt(JsonVariant json)
+void _apiSelfTestUpload(Request &req, Response &res)
 {
-  // Build device adoption info
-  _getFirmwareJson(json);
-  _getSystemJson(json);
-  _getNetworkJson(json);
-  _getConfigSchemaJson(json);
-  _getCommandSchemaJson(json);
+  // Read and discard the body, timing how fast it arrives
+  uint8_t buffer[FILES_CHUNK_SIZE];
+  uint32_t start = millis();
+  uint32_t received = 0;
+
+  while (req.left() > 0)
+  {
+    int length = req.readBytes(buffer, min((uint32_t)req.left(), (uint32_t)sizeof(buffer)));
+    if (length <= 0) { break; }
+    received += length;
+  }
+
+  uint32_t elapsed = millis() - start;
+  _selfTestUploadBps = elapsed ? (uint32_t)((uint64_t)received * 1000 / elapsed) : 0;
+
+  DynamicJsonDocument json(512);
+  _getSelfTestJson(json.as<JsonVariant>());
+
+  res.set("Content-Type", "application/json");
+  serializeJson(json, res);
 }
+#endif
 
 /* MQTT callbacks */
 void _mqttConnected() 
 {
+#if !defined(OXRS_32_DISABLE_LOGGER)
   // MqttLogger doesn't copy the logging topic to an internal
   // buffer so we have to use a static array here
   static char logTopic[64];
   _logger.setTopic(_mqtt.getLogTopic(logTopic));
+#endif
+
+  // Update the health of the broker we just connected to
+  _brokerConnected();
 
-  // Publish device adoption info
+  // Note when we were first fully operational after boot
+  boolean firstConnect = (_bootMqttConnectedUs == 0);
+  if (firstConnect) { _bootMqttConnectedUs = micros(); }
+
+  // Publish device adoption info, sizing the MQTT buffer to fit it
+  // (which will also shrink it back down if it had grown previously)
   DynamicJsonDocument json(JSON_ADOPT_MAX_SIZE);
-  _mqtt.publishAdopt(_api.getAdopt(json.as<JsonVariant>()));
+#if defined(OXRS_32_DISABLE_REST_API)
+  JsonVariant adopt = json.as<JsonVariant>();
+  _apiAdopt(adopt);
+#else
+  JsonVariant adopt = _api.getAdopt(json.as<JsonVariant>());
+#endif
+
+  char topic[64];
+  _mqttOutboundHighWater = _mqttPacketSize(_mqtt.getAdoptTopic(topic), measureJson(adopt));
+  _mqttResizeBuffer(_mqttOutboundHighWater);
+
+  _mqtt.publishAdopt(adopt);
 
   // Log the fact we are now connected
   _logger.println("[esp32] mqtt connected");
+
+  // Boot profile is also in the stats, but log it once
+  if (firstConnect) { _logBootProfile(); }
 }
 
 void _mqttDisconnected(int state) 
@@ -207,12 +2288,18 @@ void _mqttDisconnected(int state)
       _logger.println(F("[esp32] mqtt unauthorised"));
       break;      
   }
+
+  // Fail over to another broker if this one keeps failing
+  _brokerDisconnected(state);
 }
 
 void _mqttConfig(JsonVariant json)
 {
+  // Check for GPIO32 config
+  _wifiConfig(json);
+
   // Pass on to the firmware callback
-  if (_onConfig) { _onConfig(json); }
+  if (_onConfig) { _timeHandler(&_configTiming, F("config"), _onConfig, json); }
 }
 
 void _mqttCommand(JsonVariant json)
@@ -223,14 +2310,259 @@ void _mqttCommand(JsonVariant json)
     ESP.restart();
   }
 
+  // Reply to pings (from loop()), to measure command latency
+  if (json.containsKey("ping"))
+  {
+    _pongValue = json["ping"].as<long>();
+    _pongPending = true;
+  }
+
+#if !defined(OXRS_32_DISABLE_REST_API) && defined(__XTENSA__)
+  // Start the sampling profiler
+  if (json.containsKey("profile"))
+  {
+    _profilerStart(json["profile"].as<uint32_t>());
+  }
+#endif
+
+  // Start/stop capturing MQTT traffic
+  if (json.containsKey("capture"))
+  {
+    _captureStart(json["capture"] | "off");
+  }
+
+  // Benchmark the adoption builders and publish the results to tele/
+  // (from loop())
+  if (json.containsKey("benchAdopt"))
+  {
+    _benchAdoptPending = min(json["benchAdopt"].as<uint32_t>(), (uint32_t)ADOPT_BENCH_MAX_ITERATIONS);
+  }
+
+  // Start the network self test, results are published when done
+  if (json.containsKey("selfTest") && json["selfTest"].as<bool>())
+  {
+    _selfTestStart();
+  }
+
+  // Publish our runtime stats to tele/ (from loop())
+  if (json.containsKey("stats") && json["stats"].as<bool>())
+  {
+    _statsPending = true;
+  }
+
   // Pass on to the firmware callback
-  if (_onCommand) { _onCommand(json); }
+  if (_onCommand) { _timeHandler(&_commandTiming, F("command"), _onCommand, json); }
 }
 
-void _mqttCallback(char * topic, byte * payload, int length) 
+void _commandReplies(void)
+{
+  if (_pongPending)
+  {
+    _pongPending = false;
+
+    StaticJsonDocument<64> pong;
+    pong["pong"] = _pongValue;
+    _publishStatus(pong.as<JsonVariant>());
+  }
+
+  if (_statsPending)
+  {
+    _statsPending = false;
+
+    DynamicJsonDocument stats(JSON_ADOPT_MAX_SIZE);
+    _getStatsJson(stats.as<JsonVariant>());
+    _publishTelemetry(stats.as<JsonVariant>());
+  }
+
+  if (_benchAdoptPending)
+  {
+    memset(_adoptTiming, 0, sizeof(_adoptTiming));
+
+    for (uint32_t i = 0; i < _benchAdoptPending; i++)
+    {
+      DynamicJsonDocument adopt(JSON_ADOPT_MAX_SIZE);
+      _apiAdopt(adopt.as<JsonVariant>());
+    }
+    _benchAdoptPending = 0;
+
+    DynamicJsonDocument bench(1024);
+    _getAdoptTimingJson(bench.as<JsonVariant>());
+    _publishTelemetry(bench.as<JsonVariant>());
+  }
+}
+
+/* Streaming config parser */
+int _jsonSkipWhitespace(const char * json, int pos, int length)
+{
+  while (pos < length && isspace((unsigned char)json[pos])) { pos++; }
+  return pos;
+}
+
+// Returns the index just past the value starting at pos, or -1 if truncated
+int _jsonSkipValue(const char * json, int pos, int length)
+{
+  int depth = 0;
+  boolean inString = false;
+
+  for (; pos < length; pos++)
+  {
+    char c = json[pos];
+
+    if (inString)
+    {
+      if (c == '\\') 
+      { 
+        pos++; 
+      }
+      else if (c == '"')
+      {
+        inString = false;
+        if (depth == 0) { return pos + 1; }
+      }
+      continue;
+    }
+
+    switch (c)
+    {
+      case '"':
+        inString = true;
+        break;
+      case '{':
+      case '[':
+        depth++;
+        break;
+      case '}':
+      case ']':
+        if (depth == 0) { return pos; }
+        if (--depth == 0) { return pos + 1; }
+        break;
+      case ',':
+        if (depth == 0) { return pos; }
+        break;
+      default:
+        if (depth == 0 && isspace((unsigned char)c)) { return pos; }
+        break;
+    }
+  }
+
+  // Only a scalar can legitimately run up to the end of the payload
+  return (depth == 0 && !inString) ? pos : -1;
+}
+
+boolean _mqttConfigFragment(const char * key, int keyLength, const char * value, int valueLength, boolean element)
+{
+  // Rebuild a standalone object for this key (keeping arrays as arrays)
+  char text[JSON_CONFIG_FRAGMENT_MAX_SIZE];
+  int textLength = snprintf(text, sizeof(text), element ? "{%.*s:[%.*s]}" : "{%.*s:%.*s}", keyLength, key, valueLength, value);
+  if (textLength >= (int)sizeof(text))
+  {
+    _logger.print(F("[esp32] mqtt config fragment too large: "));
+    _logger.write((const uint8_t *)key, keyLength);
+    _logger.println();
+    return false;
+  }
+
+  DynamicJsonDocument json(JSON_CONFIG_FRAGMENT_MAX_SIZE);
+  if (deserializeJson(json, text, textLength)) { return false; }
+
+  _configFragments++;
+  if ((uint32_t)textLength > _configFragmentMaxBytes) { _configFragmentMaxBytes = textLength; }
+
+  _mqttConfig(json.as<JsonVariant>());
+  return true;
+}
+
+int _mqttStreamConfig(const char * json, int length)
+{
+  if (length == 0) { return MQTT_RECEIVE_ZERO_LENGTH; }
+
+  int pos = _jsonSkipWhitespace(json, 0, length);
+  if (pos >= length || json[pos] != '{') { return MQTT_RECEIVE_JSON_ERROR; }
+  pos++;
+
+  while (true)
+  {
+    pos = _jsonSkipWhitespace(json, pos, length);
+    if (pos >= length) { return MQTT_RECEIVE_JSON_ERROR; }
+    if (json[pos] == '}') { return MQTT_RECEIVE_OK; }
+
+    // Key, left in its raw (still escaped) form since we re-parse it
+    if (json[pos] != '"') { return MQTT_RECEIVE_JSON_ERROR; }
+    int keyStart = pos;
+    pos = _jsonSkipValue(json, pos, length);
+    if (pos < 0) { return MQTT_RECEIVE_JSON_ERROR; }
+    int keyLength = pos - keyStart;
+
+    pos = _jsonSkipWhitespace(json, pos, length);
+    if (pos >= length || json[pos] != ':') { return MQTT_RECEIVE_JSON_ERROR; }
+    pos = _jsonSkipWhitespace(json, pos + 1, length);
+    if (pos >= length) { return MQTT_RECEIVE_JSON_ERROR; }
+
+    if (json[pos] == '[')
+    {
+      // Arrays (e.g. channel config) are handled one element at a time
+      int elements = 0;
+      pos++;
+
+      while (true)
+      {
+        pos = _jsonSkipWhitespace(json, pos, length);
+        if (pos >= length) { return MQTT_RECEIVE_JSON_ERROR; }
+        if (json[pos] == ']') { pos++; break; }
+
+        int start = pos;
+        pos = _jsonSkipValue(json, pos, length);
+        if (pos <= start) { return MQTT_RECEIVE_JSON_ERROR; }
+        if (!_mqttConfigFragment(&json[keyStart], keyLength, &json[start], pos - start, true)) { return MQTT_RECEIVE_JSON_ERROR; }
+        elements++;
+
+        pos = _jsonSkipWhitespace(json, pos, length);
+        if (pos < length && json[pos] == ',') { pos++; }
+      }
+
+      // Still pass on empty arrays, they may mean 'clear'
+      if (elements == 0 && !_mqttConfigFragment(&json[keyStart], keyLength, "", 0, true)) { return MQTT_RECEIVE_JSON_ERROR; }
+    }
+    else
+    {
+      int start = pos;
+      pos = _jsonSkipValue(json, pos, length);
+      if (pos <= start) { return MQTT_RECEIVE_JSON_ERROR; }
+      if (!_mqttConfigFragment(&json[keyStart], keyLength, &json[start], pos - start, false)) { return MQTT_RECEIVE_JSON_ERROR; }
+    }
+
+    pos = _jsonSkipWhitespace(json, pos, length);
+    if (pos < length && json[pos] == ',') { pos++; }
+  }
+}
+
+boolean _isConfigTopic(const char * topic)
+{
+  char configTopic[64];
+  return strcmp(topic, _mqtt.getConfigTopic(configTopic)) == 0;
+}
+
+void _mqttDispatch(char * topic, byte * payload, int length)
 {
+  uint32_t start = micros();
+
   // Pass down to our MQTT handler and check it was processed ok
-  int state = _mqtt.receive(topic, payload, length);
+  // NOTE: fragments already delivered stay applied if we hit an error
+  int state;
+  if (_configStreaming && _isConfigTopic(topic))
+  {
+    state = _mqttStreamConfig((const char *)payload, length);
+  }
+  else
+  {
+    state = _mqtt.receive(topic, payload, length);
+  }
+
+  uint32_t elapsed = micros() - start;
+  _rxDispatches++;
+  _rxDispatchTotalUs += elapsed;
+  if (elapsed > _rxDispatchMaxUs) { _rxDispatchMaxUs = elapsed; }
+
   switch (state)
   {
     case MQTT_RECEIVE_ZERO_LENGTH:
@@ -248,9 +2580,100 @@ void _mqttCallback(char * topic, byte * payload, int length)
   }
 }
 
+/* Deferred dispatch */
+void _rxDrain(void)
+{
+  while (_rxCount > 0)
+  {
+    rxSlot_t * slot = &_rxQueue[_rxHead];
+
+    uint32_t wait = micros() - slot->receivedUs;
+    _rxWaitTotalUs += wait;
+    if (wait > _rxWaitMaxUs) { _rxWaitMaxUs = wait; }
+
+    // Handlers may publish, which can't touch this slot, so only
+    // release it once we are done
+    _mqttDispatch(slot->topic, slot->payload, slot->length);
+
+    _rxHead = (_rxHead + 1) % MQTT_RX_QUEUE_DEPTH;
+    _rxCount--;
+  }
+}
+
+boolean _rxEnqueue(char * topic, byte * payload, int length)
+{
+  if (_rxCount >= MQTT_RX_QUEUE_DEPTH) { return false; }
+  if (length > MQTT_RX_QUEUE_SLOT_SIZE) { return false; }
+  if (strlen(topic) >= sizeof(_rxQueue[0].topic)) { return false; }
+
+  rxSlot_t * slot = &_rxQueue[(_rxHead + _rxCount) % MQTT_RX_QUEUE_DEPTH];
+  slot->receivedUs = micros();
+  slot->length = length;
+  strcpy(slot->topic, topic);
+  memcpy(slot->payload, payload, length);
+
+  _rxCount++;
+  _rxQueued++;
+  if (_rxCount > _rxDepthHighWater) { _rxDepthHighWater = _rxCount; }
+  return true;
+}
+
+void _mqttCallback(char * topic, byte * payload, int length) 
+{
+  // Make sure we are running flat out to handle this
+  _loopActivity();
+
+  // Track the largest message received so the buffer is never shrunk below it
+  size_t packetSize = _mqttPacketSize(topic, length);
+  if (packetSize > _mqttInboundHighWater) { _mqttInboundHighWater = packetSize; }
+
+  // Record it if we are capturing traffic
+  _captureMessage(topic, payload, length);
+
+  // Copy into our queue and handle it from loop() if we can
+  if (_rxDeferred && _rxEnqueue(topic, payload, length)) { return; }
+
+  // Otherwise handle inline, but after anything already queued so
+  // messages are still handled in the order they arrived
+  _inMqttCallback = true;
+  if (_rxDeferred) { _rxInline++; }
+
+  if (_rxCount == 0)
+  {
+    _mqttDispatch(topic, payload, length);
+  }
+  else
+  {
+    // Queued handlers may publish, overwriting the MQTT library buffer
+    // which topic and payload point into, so take a copy first
+    size_t topicLength = strlen(topic) + 1;
+    char * copy = (char *)malloc(topicLength + length);
+    if (copy)
+    {
+      memcpy(copy, topic, topicLength);
+      memcpy(copy + topicLength, payload, length);
+
+      _rxDrain();
+      _mqttDispatch(copy, (byte *)copy + topicLength, length);
+      free(copy);
+    }
+    else
+    {
+      _rxDropped++;
+      _rxDrain();
+      _logger.println(F("[esp32] no memory for inline mqtt message, dropped"));
+    }
+  }
+
+  _inMqttCallback = false;
+}
+
 /* Main program */
 void OXRS_32::begin(jsonCallback config, jsonCallback command)
 {
+  // Everything before we get control (bootloader, setup() preamble)
+  _bootPhase("preBeginMs");
+
   // Get our firmware details
   DynamicJsonDocument json(512);
   _getFirmwareJson(json.as<JsonVariant>());
@@ -259,33 +2682,94 @@ void OXRS_32::begin(jsonCallback config, jsonCallback command)
   _logger.print(F("[esp32] "));
   serializeJson(json, _logger);
   _logger.println();
+  _bootPhase("firmwareMs");
+
+  // Restore any broker addresses cached before a warm restart
+  _dnsInit();
+
+  // Map our read-only assets (if any)
+  _assetsInit();
 
   // We wrap the callbacks so we can intercept messages intended for the GPIO32
   _onConfig = config;
   _onCommand = command;
   
-  // Set up network and obtain an IP address
+  // Start connecting to the network (doesn't wait for an IP address)
   byte mac[6];
   _initialiseNetwork(mac);
+  _bootPhase("networkMs");
+
+  // Set up MQTT and the REST API while WiFi associates, neither needs
+  // an IP address and the REST API has to load its config from flash
 
   // Set up MQTT (don't attempt to connect yet)
   _initialiseMqtt(mac);
+  _bootPhase("mqttMs");
 
   // Set up the REST API
   _initialiseRestApi();
+  _bootPhase("restApiMs");
+
+  // Now wait for the network to come up
+  _waitForNetwork();
+  _bootPhase("networkWaitMs");
 }
 
 void OXRS_32::loop(void)
 {
+  // Restart into new firmware after a successful OTA update
+  if (_otaRestartMs && (millis() - _otaRestartMs) > OTA_RESTART_DELAY_MS)
+  {
+    ESP.restart();
+  }
+
+#if defined(__XTENSA__)
+  // Stop the profiler once its time is up
+  _profilerLoop();
+#endif
+
+  uint32_t loopStart = micros();
+  _loopActive = false;
+
   // Check our network connection
   if (_isNetworkConnected())
   {
     // Handle any MQTT messages
     _mqtt.loop();
+
+    // Handle any MQTT messages queued by the callback
+    _rxDrain();
+
+    // Publish any replies to generic commands
+    _commandReplies();
+
+    // Retry any status messages which failed to publish
+    _retryFlush();
+
+    // Refresh any stale broker addresses
+    _dnsRevalidate();
+
+    // Go back to the configured broker once it recovers
+    _brokerFailback();
+
+    // Take the next network self test sample (if running)
+    _selfTestLoop();
     
+#if !defined(OXRS_32_DISABLE_REST_API)
     // Handle any REST API requests
     WiFiClient client = _server.available();
+    if (client) { _loopActivity(); }
     _api.loop(&client);
+#endif
+  }
+
+  // Let the governor know how long all that took
+  _governorLoop(micros() - loopStart);
+
+  // Nothing happened and nothing waiting, so sleep until something does
+  if (!_loopActive && _retryCount == 0 && _otaRestartMs == 0 && _selfTestRemaining == 0)
+  {
+    _idleSleep();
   }
 }
 
@@ -301,28 +2785,144 @@ void OXRS_32::setCommandSchema(JsonVariant json)
   _mergeJson(_fwCommandSchema.as<JsonVariant>(), json);
 }
 
+void OXRS_32::setCpuGovernor(boolean enabled)
+{
+  if (enabled == _governorEnabled) { return; }
+
+  // Always start (and finish) at full speed
+  setCpuFrequencyMhz(_governorMhz[0]);
+  _governorProfile = 0;
+  _governorProfileStartMs = millis();
+  _governorLastStepMs = millis();
+
+  _governorEnabled = enabled;
+}
+
+void OXRS_32::setIdleSleep(uint32_t maxSleepMs)
+{
+#if CONFIG_PM_ENABLE
+  // Let the SoC light sleep between DTIM beacons whenever we are blocked
+  esp_pm_config_esp32_t pm;
+  pm.max_freq_mhz = getCpuFrequencyMhz();
+  pm.min_freq_mhz = maxSleepMs ? 80 : pm.max_freq_mhz;
+  pm.light_sleep_enable = maxSleepMs > 0;
+  esp_pm_configure(&pm);
+#endif
+
+  _idleSleepMaxMs = maxSleepMs;
+  _idleSleepEnabledMs = millis();
+  _idleSleeps = 0;
+  _idleSocketWakes = 0;
+  _idleSleptMs = 0;
+}
+
+void OXRS_32::setWifiProfile(wifiProfile_t profile)
+{
+  // Before begin() this only records the profile, it is applied once
+  // the WiFi driver has started
+  _wifiApplyProfile(profile);
+}
+
+void OXRS_32::setConfigStreaming(boolean enabled)
+{
+  _configStreaming = enabled;
+}
+
+void OXRS_32::setMessageStamping(boolean enabled, const char * ntpServer)
+{
+  // Runs in the background (lwIP SNTP), doesn't block waiting for a sync
+  // NOTE: not via configTime(), which would reset the firmware's TZ
+  if (enabled && !_stampingEnabled)
+  {
+    // lwIP only keeps a pointer to the server name
+    strncpy(_stampingNtpServer, ntpServer, sizeof(_stampingNtpServer) - 1);
+  }
+
+  boolean start = enabled && !_stampingEnabled;
+  _stampingEnabled = enabled;
+
+  if (start) { _stampingStartSntp(); }
+}
+
+boolean OXRS_32::setDeferredDispatch(boolean enabled)
+{
+  // Flush anything queued if we are switching back to inline
+  if (!enabled) 
+  { 
+    _rxDrain(); 
+  }
+  else if (!_rxQueue)
+  {
+    _rxQueue = (rxSlot_t *)malloc(sizeof(rxSlot_t) * MQTT_RX_QUEUE_DEPTH);
+    if (!_rxQueue) { return false; }
+  }
+
+  _rxDeferred = enabled;
+  return true;
+}
+
+void OXRS_32::setHandlerWarningThreshold(uint32_t thresholdUs)
+{
+  _handlerWarningUs = thresholdUs;
+}
+
+boolean OXRS_32::addAsset(const char * name, const uint8_t * data, uint32_t length, boolean gzip)
+{
+  if (_embeddedAssetCount >= ASSETS_MAX_EMBEDDED) { return false; }
+
+  asset_t * asset = &_embeddedAssets[_embeddedAssetCount++];
+  asset->name = name;
+  asset->data = data;
+  asset->length = length;
+  asset->flags = gzip ? ASSETS_FLAG_GZIP : 0;
+  return true;
+}
+
+boolean OXRS_32::addBroker(const char * broker, uint16_t port)
+{
+  if (_brokerCount >= MQTT_MAX_BROKERS) { return false; }
+  if (strlen(broker) >= sizeof(_brokers[0].host)) { return false; }
+
+  broker_t * b = &_brokers[_brokerCount++];
+  strcpy(b->host, broker);
+  b->port = port;
+  b->failures = 0;
+  b->connectMs = 0;
+  return true;
+}
+
+#if defined(OXRS_32_MQTT_TLS)
+void OXRS_32::setMqttCACert(const char * rootCA)
+{
+  _client.setCACert(rootCA);
+}
+#endif
+
 OXRS_MQTT * OXRS_32::getMQTT()
 {
   return &_mqtt;
 }
 
+#if !defined(OXRS_32_DISABLE_REST_API)
 OXRS_API * OXRS_32::getAPI()
 {
   return &_api;
 }
+#endif
 
 boolean OXRS_32::publishStatus(JsonVariant json)
 {
-  // Exit early if no network connection
-  if (!_isNetworkConnected()) { return false; }
-  return _mqtt.publishStatus(json);
+  return _publishStatus(json);
 }
 
 boolean OXRS_32::publishTelemetry(JsonVariant json)
 {
-  // Exit early if no network connection
-  if (!_isNetworkConnected()) { return false; }
-  return _mqtt.publishTelemetry(json);
+  return _publishTelemetry(json);
+}
+
+void OXRS_32::getStats(JsonVariant json)
+{
+  _getStatsJson(json);
 }
 
 size_t OXRS_32::write(uint8_t character)
@@ -346,10 +2946,38 @@ void OXRS_32::_initialiseNetwork(byte * mac)
   // Ensure we are in the correct WiFi mode
   WiFi.mode(WIFI_STA);
 
-  // Connect using saved creds, or start captive portal if none found
-  // NOTE: Blocks until connected or the portal is closed
+  // Start SNTP if message stamping was enabled before begin()
+  if (_stampingEnabled && !sntp_enabled())
+  {
+    _stampingStartSntp();
+  }
+
+  // Apply any WiFi profile set before begin(), ahead of associating so
+  // the listen interval is used from the start
+  if (_wifiProfileRequested != -1)
+  {
+    _wifiApplyProfile((wifiProfile_t)_wifiProfileRequested);
+  }
+
+  // Start connecting using saved creds (if any), we check the result
+  // in _waitForNetwork() once everything else has been initialised
   WiFiManager wm;
-  bool success = wm.autoConnect("OXRS_WiFi", "superhouse");
+  _wifiSaved = wm.getWiFiIsSaved();
+  if (_wifiSaved) { WiFi.begin(); }
+}
+
+void OXRS_32::_waitForNetwork(void)
+{
+  bool success = _wifiSaved && WiFi.waitForConnectResult(WIFI_CONNECT_TIMEOUT_MS) == WL_CONNECTED;
+
+  // No saved creds, or they didn't work, so go straight to the captive
+  // portal (autoConnect() would try the saved creds all over again)
+  // NOTE: Blocks until connected or the portal is closed
+  if (!success)
+  {
+    WiFiManager wm;
+    success = wm.startConfigPortal("OXRS_WiFi", "superhouse");
+  }
 
   _logger.print(F("[esp32] ip address: "));
   _logger.println(success ? WiFi.localIP() : IPAddress(0, 0, 0, 0));
@@ -373,6 +3001,13 @@ void OXRS_32::_initialiseMqtt(byte * mac)
   
   // Start listening for MQTT messages
   _mqttClient.setCallback(_mqttCallback);
+
+  // PubSubClient drops inbound messages which don't fit in its buffer
+  // before we ever see them, so never shrink below what it started with
+  if (_mqttClient.getBufferSize() > _mqttBufferFloor)
+  {
+    _mqttBufferFloor = _mqttClient.getBufferSize();
+  }
 }
 
 void OXRS_32::_initialiseRestApi(void)
@@ -381,14 +3016,37 @@ void OXRS_32::_initialiseRestApi(void)
   //       the default client id, which has lower precendence than MQTT
   //       settings stored in file and loaded by the API
 
+#if !defined(OXRS_32_DISABLE_REST_API)
   // Set up the REST API
   _api.begin();
   
   // Register our callbacks
   _api.onAdopt(_apiAdopt);
 
+  // Register our endpoints
+#if defined(OXRS_32_ENABLE_OTA)
+  _api.post("/ota", &_apiOta);
+#endif
+#if defined(__XTENSA__)
+  _api.get("/profile", &_apiProfile);
+#endif
+  _api.get("/capture", &_apiCapture);
+  _api.get("/assets/:name", &_apiAsset);
+  _api.get("/files/:name", &_apiFileDownload);
+  _api.post("/files/:name", &_apiFileUpload);
+  _api.get("/selftest", &_apiSelfTestDownload);
+  _api.post("/selftest", &_apiSelfTestUpload);
+
+  // Serve a local UI if we have one
+  asset_t index;
+  if (_assetLookup("index.html", &index))
+  {
+    _api.get("/", &_apiAssetIndex);
+  }
+
   // Start listening
   _server.begin();
+#endif
 }
 
 boolean OXRS_32::_isNetworkConnected(void)
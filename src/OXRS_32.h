@@ -5,16 +5,143 @@
 #ifndef OXRS_32_H
 #define OXRS_32_H
 
+// Optional build flags
+//   OXRS_32_DISABLE_REST_API   no REST API/LittleFS, MQTT settings must
+//                              then be configured by firmware via getMQTT()
+//   OXRS_32_DISABLE_LOGGER     log to serial only, not to MQTT
+//   OXRS_32_MQTT_TLS           connect to the MQTT broker over TLS
+//   OXRS_32_ENABLE_OTA         accept firmware updates via POST /ota - there
+//                              is no authentication, anyone on the LAN can
+//                              flash the device
+
 #include <OXRS_MQTT.h>                // For MQTT pub/sub
+#if !defined(OXRS_32_DISABLE_REST_API)
 #include <OXRS_API.h>                 // For REST API
+#endif
+
+// Adoption payload/schema settings (normally from the REST API library)
+#ifndef JSON_ADOPT_MAX_SIZE
+#define       JSON_ADOPT_MAX_SIZE       4096
+#endif
+#ifndef JSON_SCHEMA_VERSION
+#define       JSON_SCHEMA_VERSION       "http://json-schema.org/draft-07/schema#"
+#endif
 
 // I2C
 #define       I2C_SDA                   21
 #define       I2C_SCL                   22
 
+// WiFi - how long to wait for saved creds before starting the captive portal
+#ifndef WIFI_CONNECT_TIMEOUT_MS
+#define       WIFI_CONNECT_TIMEOUT_MS   15000
+#endif
+
 // REST API
 #define       REST_API_PORT             80
 
+// OTA firmware updates via the REST API (POST /ota, see OXRS_32_ENABLE_OTA)
+#define       OTA_CHUNK_SIZE            1024
+#define       OTA_RESTART_DELAY_MS      1000
+
+// MQTT status retry window (fixed size, no heap allocation)
+#ifndef MQTT_RETRY_WINDOW_SIZE
+#define       MQTT_RETRY_WINDOW_SIZE    4
+#endif
+#ifndef MQTT_RETRY_PAYLOAD_SIZE
+#define       MQTT_RETRY_PAYLOAD_SIZE   256
+#endif
+#define       MQTT_RETRY_INTERVAL_MS    1000
+#define       MQTT_RETRY_MAX_ATTEMPTS   10
+
+// MQTT buffer is sized at runtime, but never below this or the size it
+// started with - inbound messages which don't fit are silently dropped,
+// so this is the largest config/command which can be received
+#ifndef MQTT_MIN_BUFFER_SIZE
+#define       MQTT_MIN_BUFFER_SIZE      4096
+#endif
+
+// MQTT broker failover
+#ifndef MQTT_MAX_BROKERS
+#define       MQTT_MAX_BROKERS          4
+#endif
+#define       MQTT_BROKER_MAX_FAILURES  3
+#define       MQTT_BROKER_PENALTY_MS    10000
+#define       MQTT_BROKER_FAILBACK_MS   300000
+#define       MQTT_BROKER_PROBE_TIMEOUT_MS 1000
+
+// DNS cache for broker hostnames (kept across warm restarts), one
+// entry per failover broker plus the one configured via the API
+#define       DNS_CACHE_SIZE            (MQTT_MAX_BROKERS + 1)
+#ifndef DNS_CACHE_TTL_MS
+#define       DNS_CACHE_TTL_MS          3600000
+#endif
+
+// Streaming config - max size of a single config fragment (see setConfigStreaming)
+#ifndef JSON_CONFIG_FRAGMENT_MAX_SIZE
+#define       JSON_CONFIG_FRAGMENT_MAX_SIZE 1024
+#endif
+
+// Deferred dispatch queue for inbound MQTT messages (see setDeferredDispatch)
+#ifndef MQTT_RX_QUEUE_DEPTH
+#define       MQTT_RX_QUEUE_DEPTH       4
+#endif
+#ifndef MQTT_RX_QUEUE_SLOT_SIZE
+#define       MQTT_RX_QUEUE_SLOT_SIZE   1024
+#endif
+
+// WiFi latency/power profiles (also selectable via config 'wifiProfile')
+enum wifiProfile_t { WIFI_PROFILE_LOW_LATENCY, WIFI_PROFILE_BALANCED, WIFI_PROFILE_LOW_POWER };
+
+// CPU frequency governor (steps down a profile each idle period)
+#define       GOVERNOR_PROFILES         3
+#define       GOVERNOR_IDLE_MS          5000
+
+// Sampling CPU profiler (start with the 'profile' command, results at GET /profile)
+// Xtensa only (ESP32/S2/S3), it reads the interrupted PC from EPC1
+// NOTE: override PROFILER_TIMER if your firmware already uses hardware timer 3
+#ifndef PROFILER_TIMER
+#define       PROFILER_TIMER            3
+#endif
+#define       PROFILER_SAMPLE_HZ        1000
+#define       PROFILER_BUCKETS          256
+#define       PROFILER_MAX_SECONDS      60
+
+// LittleFS file upload/download via the REST API (GET/POST /files/<name>),
+// confined to their own directory
+#define       FILES_DIR                 "/files"
+#define       FILES_CHUNK_SIZE          512
+#define       FILES_NAME_SIZE           32
+
+// MQTT traffic capture (start with the 'capture' command, see extras/replay)
+#define       CAPTURE_FILE              "/capture.log"
+#ifndef CAPTURE_MAX_BYTES
+#define       CAPTURE_MAX_BYTES         65536
+#endif
+
+// Adoption builder benchmark ('benchAdopt' command)
+#define       ADOPT_BENCH_MAX_ITERATIONS 100
+
+// Read-only asset partition, memory mapped and served from flash (see extras/assets)
+#define       ASSETS_PARTITION_LABEL    "assets"
+#define       ASSETS_MAGIC              0x3141584f
+#define       ASSETS_NAME_SIZE          48
+#define       ASSETS_FLAG_GZIP          0x01
+#ifndef ASSETS_MAX_EMBEDDED
+#define       ASSETS_MAX_EMBEDDED       8
+#endif
+#define       ASSETS_CHUNK_SIZE         1024
+#ifndef ASSETS_MAX_AGE
+#define       ASSETS_MAX_AGE            3600
+#endif
+
+// Network self test ('selfTest' command, plus GET/POST /selftest for REST clients)
+#define       SELFTEST_SAMPLES          10
+#define       SELFTEST_TIMEOUT_MS       1000
+#define       SELFTEST_MAX_BYTES        1048576
+
+// Boot profiler
+#define       BOOT_MAX_PHASES           8
+
 class OXRS_32 : public Print
 {
   public:
@@ -25,22 +152,77 @@ class OXRS_32 : public Print
     void setConfigSchema(JsonVariant json);
     void setCommandSchema(JsonVariant json);
 
+    // Additional brokers to fail over to if the configured one is unavailable
+    // (we fail back once the configured broker accepts connections again)
+    boolean addBroker(const char * broker, uint16_t port);
+
+#if defined(OXRS_32_MQTT_TLS)
+    // Root CA used to verify the broker when connecting over TLS
+    void setMqttCACert(const char * rootCA);
+#endif
+
+    // Scale CPU frequency down when idle, and back up on MQTT/REST activity
+    void setCpuGovernor(boolean enabled);
+
+    // Sleep for up to this long in loop() when idle (0 to disable), waking
+    // early on inbound MQTT data - uses automatic light sleep if enabled
+    // in the SDK (CONFIG_PM_ENABLE), don't combine with the CPU governor
+    void setIdleSleep(uint32_t maxSleepMs);
+
+    // Trade WiFi command latency against power (can be called before
+    // begin(), listen interval changes only take effect on the next
+    // association)
+    void setWifiProfile(wifiProfile_t profile);
+
+    // Parse config payloads incrementally, calling the config handler once
+    // per top-level key (and once per element for arrays) rather than once
+    // with the whole payload, so config size isn't limited by the JSON
+    // document size (only JSON_CONFIG_FRAGMENT_MAX_SIZE per fragment)
+    // NOTE: the whole payload must still fit in the MQTT buffer, which is
+    //       never grown for inbound messages (see MQTT_MIN_BUFFER_SIZE)
+    void setConfigStreaming(boolean enabled);
+
+    // Add 'seq' (per topic sequence number) and 'ts' (epoch ms, once SNTP
+    // has synced in the background) to every stat/ and tele/ message (can
+    // be called before begin(), SNTP is then started once WiFi is up)
+    void setMessageStamping(boolean enabled, const char * ntpServer = "pool.ntp.org");
+
+    // Queue inbound MQTT messages and run the config/command handlers from
+    // loop() once PubSubClient is done, rather than inside its callback
+    boolean setDeferredDispatch(boolean enabled);
+
+    // Log (and count) firmware config/command handlers slower than this (0 to disable)
+    void setHandlerWarningThreshold(uint32_t thresholdUs);
+
+    // Serve a const (i.e. flash resident) asset at /assets/<name>, with
+    // index.html also served at / - call before begin()
+    // NOTE: see extras/assets/mkassets.py to generate these at build time
+    boolean addAsset(const char * name, const uint8_t * data, uint32_t length, boolean gzip);
+
     // Return a pointer to the MQTT library
     OXRS_MQTT * getMQTT(void);
 
+#if !defined(OXRS_32_DISABLE_REST_API)
     // Return a pointer to the API library
     OXRS_API * getAPI(void);
+#endif
 
     // Helpers for publishing to stat/ and tele/ topics
+    // NOTE: status messages which fail to publish are queued for retry,
+    //       but this will still return false (i.e. not sent yet)
     boolean publishStatus(JsonVariant json);
     boolean publishTelemetry(JsonVariant json);
 
+    // Library runtime stats (also published to tele/ by the 'stats' command)
+    void getStats(JsonVariant json);
+
     // Implement Print.h wrapper
     virtual size_t write(uint8_t);
     using Print::write;
 
   private:
     void _initialiseNetwork(byte * mac);
+    void _waitForNetwork(void);
     void _initialiseMqtt(byte * mac);
     void _initialiseRestApi(void);
 